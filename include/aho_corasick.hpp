@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+namespace rkt {
+
+/**
+ * Aho-Corasick automaton for matching many literal strings in one pass.
+ *
+ * Patterns are added with an id and the automaton is then built into a
+ * dense deterministic table with one transition per state and byte, so
+ * scanning costs one table lookup per input byte regardless of the number
+ * of patterns. The table takes 1 KB per state (one state per distinct
+ * pattern prefix), which suits the tens to low thousands of patterns found
+ * in configuration files.
+ *
+ * The automaton can be driven a byte at a time with next(), which lets a
+ * caller carry the state across buffers, or over a whole buffer with find().
+ *
+ * A built automaton is immutable and may be shared between threads.
+ */
+class aho_corasick {
+public:
+    using state_type = std::uint32_t;
+
+    /** Id returned when no pattern matches. */
+    static constexpr std::uint32_t no_match = std::numeric_limits<std::uint32_t>::max();
+
+    /** The start state. */
+    static constexpr state_type root = 0;
+
+private:
+    std::vector<state_type> m_delta{std::vector<state_type>(256, root)};
+    std::vector<state_type> m_fail{root};
+    std::vector<std::uint32_t> m_depth{0};
+    // Id of the longest pattern that ends at a state, including those that
+    // end at its suffixes, or no_match.
+    std::vector<std::uint32_t> m_match{no_match};
+    std::vector<std::uint32_t> m_lengths;
+    bool m_built{false};
+
+public:
+    /**
+     * Adds a pattern. Must be called before build().
+     *
+     * @param pattern Non-empty byte string
+     * @param id Id reported for matches of the pattern. If the same pattern
+     *           is added twice the first id is kept.
+     * @throws std::invalid_argument if the pattern is empty
+     */
+    void add(std::string_view pattern, std::uint32_t id) {
+        if (pattern.empty()) throw std::invalid_argument("Empty pattern");
+        if (m_built) throw std::logic_error("Pattern added to a built automaton");
+        state_type s = root;
+        for (unsigned char c : pattern) {
+            state_type& edge = m_delta[std::size_t{s} * 256 + c];
+            if (edge == root) {
+                edge = static_cast<state_type>(m_fail.size());
+                m_delta.resize(m_delta.size() + 256, root);
+                m_fail.push_back(root);
+                m_depth.push_back(m_depth[s] + 1);
+                m_match.push_back(no_match);
+            }
+            s = m_delta[std::size_t{s} * 256 + c];
+        }
+        if (m_match[s] == no_match) m_match[s] = id;
+        if (id >= m_lengths.size()) m_lengths.resize(std::size_t{id} + 1, 0);
+        m_lengths[id] = static_cast<std::uint32_t>(pattern.size());
+    }
+
+    /**
+     * Computes the failure links and completes the transition table.
+     */
+    void build() {
+        std::queue<state_type> queue;
+        for (unsigned c = 0; c < 256; ++c) {
+            if (state_type t = m_delta[c]; t != root) queue.push(t);
+        }
+        // Breadth first, so a state's failure state is complete before the state.
+        while (!queue.empty()) {
+            state_type s = queue.front();
+            queue.pop();
+            const state_type f = m_fail[s];
+            // A pattern ending at the state itself is longer than any ending at a suffix.
+            if (m_match[s] == no_match) m_match[s] = m_match[f];
+            for (unsigned c = 0; c < 256; ++c) {
+                state_type& edge = m_delta[std::size_t{s} * 256 + c];
+                const state_type fallback = m_delta[std::size_t{f} * 256 + c];
+                if (edge != root && m_depth[edge] == m_depth[s] + 1) {
+                    m_fail[edge] = fallback;
+                    queue.push(edge);
+                } else {
+                    edge = fallback;
+                }
+            }
+        }
+        m_built = true;
+    }
+
+    /** Returns the state after consuming one byte. */
+    state_type next(state_type s, unsigned char c) const noexcept {
+        return m_delta[std::size_t{s} * 256 + c];
+    }
+
+    /** Returns the id of the longest pattern ending at a state, or no_match. */
+    std::uint32_t match(state_type s) const noexcept { return m_match[s]; }
+
+    /** Returns the length of the longest pattern prefix a state represents. */
+    std::uint32_t depth(state_type s) const noexcept { return m_depth[s]; }
+
+    /** Returns the length of a pattern. */
+    std::uint32_t length(std::uint32_t id) const noexcept { return m_lengths[id]; }
+
+    /** Returns the number of states. */
+    std::size_t states() const noexcept { return m_fail.size(); }
+
+    /** Returns true if no pattern has been added. */
+    bool empty() const noexcept { return m_fail.size() == 1; }
+
+    /**
+     * Finds the first pattern that ends in a buffer.
+     *
+     * @param data Source buffer
+     * @param size Number of bytes in the buffer
+     * @return id of the pattern, or no_match
+     */
+    std::uint32_t find(const char* data, std::size_t size) const noexcept {
+        state_type s = root;
+        for (std::size_t i = 0; i < size; ++i) {
+            s = next(s, static_cast<unsigned char>(data[i]));
+            if (m_match[s] != no_match) return m_match[s];
+        }
+        return no_match;
+    }
+};
+
+} // namespace rkt
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "compression.hpp"
+#include "file.hpp"
+#include "framing.hpp"
+#include "sink.hpp"
+
+namespace rkt::archive {
+
+/** First line of every index file. */
+inline constexpr const char* index_header = "# rktbatch seekable archive index v1";
+
+/**
+ * Index entry describing one frame of a seekable archive.
+ */
+struct frame {
+    /** Offset of the frame's first byte in the uncompressed stream. */
+    std::uint64_t offset{0};
+    /** Number of uncompressed bytes in the frame. */
+    std::uint64_t size{0};
+    /** Line number, counting from 1, of the frame's first byte. */
+    std::uint64_t line{1};
+    /** Offset of the frame's gzip member in the archive. */
+    std::uint64_t compressed_offset{0};
+    /** Size of the frame's gzip member. */
+    std::uint64_t compressed_size{0};
+    /** Time the first byte of the frame was relayed, in seconds since the epoch. */
+    std::int64_t time{0};
+};
+
+/**
+ * Formats an index entry as one line of the index file.
+ */
+inline std::string format(const frame& f) {
+    return fmt::format("{} {} {} {} {} {}\n", f.offset, f.size, f.line,
+                       f.compressed_offset, f.compressed_size, f.time);
+}
+
+/**
+ * Reads every entry of an index file.
+ *
+ * @param name Path of the index file
+ * @return the frames in archive order
+ *
+ * @throws std::runtime_error if the file cannot be read or is not an index
+ */
+inline std::vector<frame> read_index(const std::string& name) {
+    file index(name, "r");
+    FILE* fp = static_cast<FILE*>(index);
+    char line[256];
+    if (!std::fgets(line, sizeof(line), fp) || std::string(line).rfind(index_header, 0) != 0) {
+        throw std::runtime_error(name + " is not a seekable archive index");
+    }
+    std::vector<frame> frames;
+    while (std::fgets(line, sizeof(line), fp)) {
+        frame f;
+        unsigned long long offset, size, number, coffset, csize;
+        long long time;
+        if (std::sscanf(line, "%llu %llu %llu %llu %llu %lld", &offset, &size, &number, &coffset, &csize, &time) != 6) {
+            throw std::runtime_error("Malformed index entry in " + name + ": " + line);
+        }
+        f.offset = offset;
+        f.size = size;
+        f.line = number;
+        f.compressed_offset = coffset;
+        f.compressed_size = csize;
+        f.time = time;
+        frames.push_back(f);
+    }
+    return frames;
+}
+
+/**
+ * Decompresses one frame of an archive.
+ *
+ * @param archive Open archive file
+ * @param f Index entry of the frame
+ * @return the uncompressed bytes of the frame
+ *
+ * @throws std::runtime_error if the frame cannot be read or decompressed
+ */
+inline std::string read_frame(const file& archive, const frame& f) {
+    FILE* fp = static_cast<FILE*>(archive);
+    // fseeko takes offsets beyond 2 GB, where a long does not in a 31-bit build.
+    if (fseeko(fp, static_cast<off_t>(f.compressed_offset), SEEK_SET) != 0) throwError("Error seeking in archive");
+    std::vector<unsigned char> in(f.compressed_size);
+    if (archive.read(in.data(), in.size()) != in.size()) throw std::runtime_error("Archive is shorter than its index");
+    std::string out(f.size, '\0');
+    z_stream stream{};
+    int rc = inflateInit2(&stream, 15 + 16);
+    if (rc != Z_OK) compression::throw_zlib_error("inflateInit2()", rc, stream);
+    stream.next_in = in.data();
+    stream.avail_in = static_cast<uInt>(in.size());
+    stream.next_out = reinterpret_cast<Bytef*>(out.data());
+    stream.avail_out = static_cast<uInt>(out.size());
+    rc = ::inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+    if (rc != Z_STREAM_END || stream.total_out != f.size) compression::throw_zlib_error("inflate()", rc, stream);
+    return out;
+}
+
+} // namespace rkt::archive
+
+namespace rkt {
+
+/**
+ * Stage that writes a seekable compressed archive and its index.
+ *
+ * The stream is cut into frames of a fixed uncompressed size and each frame
+ * is compressed as an independent gzip member, so the archive is an ordinary
+ * multi-member gzip file. After each frame an entry is appended to the index
+ * file mapping the frame's uncompressed offset, first line number and relay
+ * time to its position in the archive. A reader can then decompress any byte
+ * range, line range or time window by reading only the frames it covers.
+ *
+ * Offsets assume the archive is written from the start of an empty file.
+ */
+class seekable_archive_sink : public stage {
+private:
+    file& m_index;
+    std::vector<char> m_frame;
+    std::size_t m_frame_size;
+    int m_level;
+    archive::frame m_current;
+    std::uint64_t m_frames{0};
+    std::uint64_t m_bytes_out{0};
+
+    void write_frame() {
+        if (m_frame.empty()) return;
+        std::vector<unsigned char> member = compression::compress(
+            m_frame.data(), m_frame.size(), compression::format::gzip, m_level);
+        m_next.write(reinterpret_cast<const char*>(member.data()), member.size());
+
+        m_current.size = m_frame.size();
+        m_current.compressed_size = member.size();
+        std::string entry = archive::format(m_current);
+        m_index.write(entry.data(), entry.size());
+
+        // Count the lines in the frame to find the first line of the next one.
+        const char* p = m_frame.data();
+        const char* end = p + m_frame.size();
+        std::uint64_t lines = 0;
+        while ((p = find_newline(p, end)) != end) {
+            ++lines;
+            ++p;
+        }
+        m_current.offset += m_current.size;
+        m_current.line += lines;
+        m_current.compressed_offset += member.size();
+        m_bytes_out += member.size();
+        ++m_frames;
+        m_frame.clear();
+    }
+
+public:
+    /**
+     * @param next Sink that receives the archive
+     * @param index Open file that receives the index
+     * @param frame_size Uncompressed bytes per frame
+     * @param level Compression level, 0 to 9
+     */
+    seekable_archive_sink(sink& next, file& index, std::size_t frame_size, int level)
+        : stage(next), m_index(index), m_frame_size(frame_size ? frame_size : 1024 * 1024), m_level(level) {
+        m_frame.reserve(m_frame_size);
+        std::string header = fmt::format("{}\n", archive::index_header);
+        m_index.write(header.data(), header.size());
+    }
+
+    void write(const char* data, std::size_t size) override {
+        while (size > 0) {
+            if (m_frame.empty()) m_current.time = static_cast<std::int64_t>(std::time(nullptr));
+            std::size_t n = std::min(size, m_frame_size - m_frame.size());
+            m_frame.insert(m_frame.end(), data, data + n);
+            data += n;
+            size -= n;
+            if (m_frame.size() == m_frame_size) write_frame();
+        }
+    }
+
+    void finish() override {
+        write_frame();
+        std::fflush(static_cast<FILE*>(m_index));
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".archive.frames", m_frames);
+        stats.add(prefix + ".archive.bytes_in", m_current.offset);
+        stats.add(prefix + ".archive.bytes_out", m_bytes_out);
+    }
+};
+
+} // namespace rkt
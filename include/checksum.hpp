@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "sink.hpp"
+#include "source.hpp"
+
+namespace rkt::checksum {
+
+namespace detail {
+
+// Slicing-by-8 tables for the reflected CRC32C (Castagnoli) polynomial.
+struct crc32c_tables {
+    std::uint32_t t[8][256];
+
+    constexpr crc32c_tables() : t{} {
+        for (std::uint32_t i = 0; i < 256; ++i) {
+            std::uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1u)));
+            t[0][i] = c;
+        }
+        for (std::uint32_t i = 0; i < 256; ++i) {
+            for (int s = 1; s < 8; ++s) t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+        }
+    }
+};
+
+inline constexpr crc32c_tables crc32c_table{};
+
+} // namespace detail
+
+/**
+ * Updates a CRC32C over a buffer.
+ *
+ * Uses the CRC32 instructions on x86 (SSE4.2) and ARM when the compiler
+ * targets them, and slicing-by-8 tables elsewhere, including z/Architecture.
+ *
+ * @param crc CRC of the preceding data, or 0 to start
+ * @param data Source buffer
+ * @param size Number of bytes in the buffer
+ * @return the CRC including the buffer
+ */
+inline std::uint32_t crc32c(std::uint32_t crc, const void* data, std::size_t size) noexcept {
+    const auto* p = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+    std::uint64_t c = crc;
+    for (; size >= 8; p += 8, size -= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = static_cast<std::uint32_t>(c);
+    for (; size > 0; ++p, --size) crc = _mm_crc32_u8(crc, *p);
+#elif defined(__ARM_FEATURE_CRC32) && defined(__aarch64__)
+    for (; size >= 8; p += 8, size -= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; ++p, --size) crc = __crc32cb(crc, *p);
+#else
+    const auto& t = detail::crc32c_table.t;
+    for (; size >= 8; p += 8, size -= 8) {
+        // Bytes are combined explicitly so the loop is independent of endianness.
+        std::uint32_t lo = crc ^ (std::uint32_t{p[0]} | std::uint32_t{p[1]} << 8
+                                  | std::uint32_t{p[2]} << 16 | std::uint32_t{p[3]} << 24);
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+            ^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    }
+    for (; size > 0; ++p, --size) crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+#endif
+    return ~crc;
+}
+
+/**
+ * Incremental SHA-256.
+ */
+class sha256 {
+private:
+    std::uint32_t m_state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    unsigned char m_block[64] = {};
+    std::size_t m_fill{0};
+    std::uint64_t m_length{0};
+
+    static constexpr std::uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+
+    static std::uint32_t rotr(std::uint32_t x, int n) noexcept { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const unsigned char* block) noexcept {
+        std::uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = std::uint32_t{block[4 * i]} << 24 | std::uint32_t{block[4 * i + 1]} << 16
+                 | std::uint32_t{block[4 * i + 2]} << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            std::uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            std::uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        std::uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+        std::uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+        for (int i = 0; i < 64; ++i) {
+            std::uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+        m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+    }
+
+public:
+    /**
+     * Adds data to the digest.
+     */
+    void update(const void* data, std::size_t size) noexcept {
+        const auto* p = static_cast<const unsigned char*>(data);
+        m_length += size;
+        if (m_fill > 0) {
+            std::size_t n = std::min(size, sizeof(m_block) - m_fill);
+            std::memcpy(m_block + m_fill, p, n);
+            m_fill += n;
+            p += n;
+            size -= n;
+            if (m_fill < sizeof(m_block)) return;
+            compress(m_block);
+            m_fill = 0;
+        }
+        for (; size >= sizeof(m_block); p += sizeof(m_block), size -= sizeof(m_block)) compress(p);
+        std::memcpy(m_block, p, size);
+        m_fill = size;
+    }
+
+    /**
+     * Returns the digest of the data added so far as lower case hex.
+     *
+     * The object is not modified, so more data may be added afterwards.
+     */
+    std::string hex() const {
+        sha256 copy = *this;
+        const std::uint64_t bits = m_length * 8;
+        unsigned char pad[72] = {0x80};
+        std::size_t pad_size = (copy.m_fill < 56 ? 56 : 120) - copy.m_fill;
+        for (int i = 0; i < 8; ++i) pad[pad_size + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        copy.update(pad, pad_size + 8);
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        for (std::uint32_t v : copy.m_state) {
+            for (int shift = 28; shift >= 0; shift -= 4) out.push_back(digits[(v >> shift) & 0xF]);
+        }
+        return out;
+    }
+};
+
+/**
+ * Byte count, CRC32C and optional SHA-256 of a relayed stream.
+ */
+class stream_digest {
+private:
+    bool m_sha256_enabled;
+    std::uint64_t m_bytes{0};
+    std::uint32_t m_crc{0};
+    sha256 m_sha256;
+    std::uint64_t m_ns{0};
+
+public:
+    /**
+     * @param with_sha256 Also compute SHA-256
+     */
+    explicit stream_digest(bool with_sha256) : m_sha256_enabled(with_sha256) {}
+
+    /** Adds relayed data to the digests. */
+    void update(const char* data, std::size_t size) noexcept {
+        auto start = std::chrono::steady_clock::now();
+        m_crc = crc32c(m_crc, data, size);
+        if (m_sha256_enabled) m_sha256.update(data, size);
+        m_bytes += size;
+        m_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    /** Adds the byte count, digests and time spent to the step statistics. */
+    void report(statistics& stats, const std::string& prefix) const {
+        stats.add(prefix + ".digest.bytes", m_bytes);
+        stats.add(prefix + ".digest.crc32c", fmt::format("{:08x}", m_crc));
+        if (m_sha256_enabled) stats.add(prefix + ".digest.sha256", m_sha256.hex());
+        stats.add(prefix + ".digest.ns", m_ns);
+    }
+};
+
+} // namespace rkt::checksum
+
+namespace rkt {
+
+/**
+ * Stage that computes digests of the data passing through it.
+ */
+class digest_sink : public stage {
+private:
+    checksum::stream_digest m_digest;
+
+public:
+    /**
+     * @param next Sink that receives the unchanged data
+     * @param with_sha256 Also compute SHA-256
+     */
+    digest_sink(sink& next, bool with_sha256) : stage(next), m_digest(with_sha256) {}
+
+    void write(const char* data, std::size_t size) override {
+        m_digest.update(data, size);
+        m_next.write(data, size);
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        m_digest.report(stats, prefix);
+    }
+};
+
+/**
+ * Source stage that computes digests of the data read through it.
+ */
+class digest_source : public source_stage {
+private:
+    checksum::stream_digest m_digest;
+
+public:
+    /**
+     * @param upstream Source of the data
+     * @param with_sha256 Also compute SHA-256
+     */
+    digest_source(source& upstream, bool with_sha256) : source_stage(upstream), m_digest(with_sha256) {}
+
+    std::size_t read(char* buffer, std::size_t size) override {
+        std::size_t n = m_upstream.read(buffer, size);
+        m_digest.update(buffer, n);
+        return n;
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        m_digest.report(stats, prefix);
+    }
+};
+
+} // namespace rkt
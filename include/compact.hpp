@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "spdlog/fmt/fmt.h"
+
+#include "framing.hpp"
+#include "sink.hpp"
+
+namespace rkt {
+
+/**
+ * Stage that collapses runs of repeated lines.
+ *
+ * The first line of a run is forwarded as it arrives; the repeats are
+ * counted and replaced by a single "[repeated N more times]" line when the
+ * run ends. A single repeat is forwarded as it was, since the marker would
+ * be no shorter. Each line is reduced to a 64-bit FNV-1a hash, so a line
+ * that differs from the previous one is usually told apart without
+ * comparing bytes; when the hashes match, the bytes are compared so a hash
+ * collision never removes a distinct line. With digit masking every decimal
+ * digit hashes and compares the same, so lines that differ only in counters
+ * or times form one run.
+ *
+ * Pieces of lines longer than the framing limit are never collapsed.
+ */
+class compact_stage : public stage {
+private:
+    bool m_mask_digits;
+    line_framer m_framer;
+    std::string m_batch;
+    bool m_have_previous{false};
+    std::uint64_t m_previous_hash{0};
+    std::string m_previous;
+    std::uint64_t m_repeats{0};
+    std::string m_first_repeat;
+    std::uint64_t m_lines_removed{0};
+    // Net of the markers added, so it can be negative for short runs.
+    std::int64_t m_bytes_removed{0};
+    std::uint64_t m_runs{0};
+
+    std::uint64_t hash(std::string_view line) const noexcept {
+        std::uint64_t h = 0xcbf29ce484222325ULL;
+        if (m_mask_digits) {
+            for (unsigned char c : line) {
+                h = (h ^ (std::isdigit(c) ? '0' : c)) * 0x100000001b3ULL;
+            }
+        } else {
+            for (unsigned char c : line) h = (h ^ c) * 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    bool same_as_previous(std::string_view line) const noexcept {
+        if (line.size() != m_previous.size()) return false;
+        if (!m_mask_digits) return std::memcmp(line.data(), m_previous.data(), line.size()) == 0;
+        for (std::size_t i = 0; i < line.size(); ++i) {
+            const auto a = static_cast<unsigned char>(line[i]);
+            const auto b = static_cast<unsigned char>(m_previous[i]);
+            if (a != b && !(std::isdigit(a) && std::isdigit(b))) return false;
+        }
+        return true;
+    }
+
+    void end_run() {
+        if (m_repeats == 0) return;
+        if (m_repeats == 1) {
+            m_batch.append(m_first_repeat);
+            m_bytes_removed -= static_cast<std::int64_t>(m_first_repeat.size());
+            --m_lines_removed;
+            m_repeats = 0;
+            return;
+        }
+        std::string marker = fmt::format("[repeated {} more times]\n", m_repeats);
+        m_bytes_removed -= static_cast<std::int64_t>(marker.size());
+        m_batch.append(marker);
+        ++m_runs;
+        m_repeats = 0;
+    }
+
+    void on_line(std::string_view line, bool terminated) {
+        if (!terminated) {
+            end_run();
+            m_have_previous = false;
+            m_batch.append(line);
+            return;
+        }
+        const std::uint64_t h = hash(line);
+        if (m_have_previous && h == m_previous_hash && same_as_previous(line)) {
+            if (m_repeats++ == 0) {
+                m_first_repeat.assign(line);
+                m_first_repeat.push_back('\n');
+            }
+            ++m_lines_removed;
+            m_bytes_removed += static_cast<std::int64_t>(line.size()) + 1;
+            return;
+        }
+        end_run();
+        m_have_previous = true;
+        m_previous_hash = h;
+        m_previous.assign(line);
+        m_batch.append(line);
+        m_batch.push_back('\n');
+    }
+
+    void forward() {
+        if (m_batch.empty()) return;
+        m_next.write(m_batch.data(), m_batch.size());
+        m_batch.clear();
+    }
+
+public:
+    /**
+     * @param next Sink that receives the compacted stream
+     * @param mask_digits Treat lines that differ only in their digits as repeats
+     */
+    compact_stage(sink& next, bool mask_digits) : stage(next), m_mask_digits(mask_digits) {
+        m_batch.reserve(8 * 1024);
+    }
+
+    void write(const char* data, std::size_t size) override {
+        m_framer.feed(data, size, [this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        forward();
+    }
+
+    void finish() override {
+        m_framer.flush([this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        end_run();
+        forward();
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".compact.runs", m_runs);
+        stats.add(prefix + ".compact.lines_removed", m_lines_removed);
+        stats.add(prefix + ".compact.bytes_removed", m_bytes_removed);
+    }
+};
+
+} // namespace rkt
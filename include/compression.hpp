@@ -0,0 +1,445 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "sink.hpp"
+#include "source.hpp"
+#include "thread_pool.hpp"
+
+namespace rkt::compression {
+
+/**
+ * Container formats written around deflate data.
+ */
+enum class format { gzip, zlib };
+
+/**
+ * Returns the zlib window bits selecting the container format.
+ */
+inline int window_bits(format f) noexcept {
+    return f == format::gzip ? 15 + 16 : 15;
+}
+
+/**
+ * Throws a std::runtime_error describing a zlib failure.
+ *
+ * @param what Name of the failing zlib function
+ * @param rc zlib return code
+ * @param stream Stream whose message is included when set
+ */
+[[noreturn]] inline void throw_zlib_error(const std::string& what, int rc, const z_stream& stream) {
+    std::string msg = what + " failed with rc=" + std::to_string(rc);
+    if (stream.msg) msg += std::string(": ") + stream.msg;
+    throw std::runtime_error(msg);
+}
+
+/**
+ * Checks whether data starts with a gzip member or a zlib stream header.
+ *
+ * @param data At least two bytes of data
+ */
+inline bool is_compressed(const unsigned char* data) noexcept {
+    if (data[0] == 0x1F && data[1] == 0x8B) return true;
+    // zlib: deflate method with a window of at most 32K and a valid header check.
+    return (data[0] & 0x0F) == Z_DEFLATED && (data[0] >> 4) <= 7 && ((data[0] << 8) | data[1]) % 31 == 0;
+}
+
+/**
+ * Compresses a buffer into one complete, independently decompressible stream.
+ *
+ * Concatenated gzip members form a valid multi-member gzip file.
+ *
+ * @param data Source buffer
+ * @param size Number of bytes in the buffer
+ * @param fmt Container format
+ * @param level Compression level, 0 to 9
+ * @return the compressed stream
+ *
+ * @throws std::runtime_error on compression failure
+ */
+inline std::vector<unsigned char> compress(const char* data, std::size_t size, format fmt, int level) {
+    z_stream stream{};
+    int rc = deflateInit2(&stream, level, Z_DEFLATED, window_bits(fmt), 8, Z_DEFAULT_STRATEGY);
+    if (rc != Z_OK) throw_zlib_error("deflateInit2()", rc, stream);
+    std::vector<unsigned char> out(deflateBound(&stream, static_cast<uLong>(size)));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream.avail_in = static_cast<uInt>(size);
+    stream.next_out = out.data();
+    stream.avail_out = static_cast<uInt>(out.size());
+    rc = ::deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (rc != Z_STREAM_END) throw_zlib_error("deflate()", rc, stream);
+    return out;
+}
+
+} // namespace rkt::compression
+
+namespace rkt {
+
+/**
+ * Stage that compresses the stream with deflate as it is relayed.
+ *
+ * The output is a gzip or zlib stream, written to the next sink in whole
+ * output buffers. When a flush interval is set, a sync flush is done after
+ * that much input so a reader of the growing file can decompress everything
+ * written so far, at some cost in compression ratio.
+ */
+class deflate_sink : public stage {
+private:
+    z_stream m_stream{};
+    std::vector<unsigned char> m_out;
+    std::size_t m_flush_interval;
+    std::size_t m_since_flush{0};
+    std::uint64_t m_bytes_in{0};
+    std::uint64_t m_bytes_out{0};
+    std::uint64_t m_compress_ns{0};
+    bool m_finished{false};
+
+    // Runs deflate until it needs more input, writing every output buffer it fills.
+    void pump(int flush) {
+        auto start = std::chrono::steady_clock::now();
+        int rc;
+        do {
+            m_stream.next_out = m_out.data();
+            m_stream.avail_out = static_cast<uInt>(m_out.size());
+            rc = ::deflate(&m_stream, flush);
+            if (rc == Z_STREAM_ERROR) compression::throw_zlib_error("deflate()", rc, m_stream);
+            std::size_t have = m_out.size() - m_stream.avail_out;
+            if (have > 0) {
+                m_next.write(reinterpret_cast<const char*>(m_out.data()), have);
+                m_bytes_out += have;
+            }
+        } while (m_stream.avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+        m_compress_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+public:
+    /**
+     * @param next Sink that receives the compressed stream
+     * @param fmt Container format
+     * @param level Compression level, 0 to 9
+     * @param flush_interval Bytes of input between sync flushes, or 0 for none
+     *
+     * @throws std::runtime_error if the compressor cannot be initialised
+     */
+    deflate_sink(sink& next, compression::format fmt, int level, std::size_t flush_interval = 0)
+        : stage(next), m_out(64 * 1024), m_flush_interval(flush_interval) {
+        int rc = deflateInit2(&m_stream, level, Z_DEFLATED, compression::window_bits(fmt), 8, Z_DEFAULT_STRATEGY);
+        if (rc != Z_OK) compression::throw_zlib_error("deflateInit2()", rc, m_stream);
+    }
+
+    deflate_sink(deflate_sink const&) = delete;
+    deflate_sink& operator=(deflate_sink const&) = delete;
+
+    ~deflate_sink() override { deflateEnd(&m_stream); }
+
+    void write(const char* data, std::size_t size) override {
+        while (size > 0) {
+            std::size_t n = size;
+            if (m_flush_interval > 0) n = std::min(n, m_flush_interval - m_since_flush);
+            m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            m_stream.avail_in = static_cast<uInt>(n);
+            m_since_flush += n;
+            bool flush = m_flush_interval > 0 && m_since_flush == m_flush_interval;
+            pump(flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+            if (flush) m_since_flush = 0;
+            m_bytes_in += n;
+            data += n;
+            size -= n;
+        }
+    }
+
+    void finish() override {
+        if (!m_finished) {
+            m_stream.next_in = nullptr;
+            m_stream.avail_in = 0;
+            pump(Z_FINISH);
+            m_finished = true;
+        }
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".compress.bytes_in", m_bytes_in);
+        stats.add(prefix + ".compress.bytes_out", m_bytes_out);
+        stats.add(prefix + ".compress.ns", m_compress_ns);
+        if (m_compress_ns > 0) {
+            stats.add(prefix + ".compress.mb_per_sec", m_bytes_in * 1000 / m_compress_ns);
+        }
+    }
+};
+
+/**
+ * Stage that compresses the stream in parallel into a multi-member gzip file.
+ *
+ * Input is cut into fixed size chunks. Each chunk is compressed as an
+ * independent gzip member by a work-stealing thread pool, and the members
+ * are written to the next sink in input order from the relay thread, so the
+ * next sink needs no locking. The relay thread only waits for compression
+ * when the number of chunks in flight reaches its limit.
+ *
+ * Members do not share a dictionary, so the output is slightly larger than
+ * a single stream compressed at the same level.
+ */
+class parallel_deflate_sink : public stage {
+private:
+    using member = std::future<std::vector<unsigned char>>;
+
+    int m_level;
+    std::size_t m_chunk_size;
+    std::size_t m_max_in_flight;
+    std::shared_ptr<std::vector<char>> m_chunk;
+    std::deque<member> m_in_flight;
+    work_stealing_pool m_pool;
+    std::uint64_t m_bytes_in{0};
+    std::uint64_t m_bytes_out{0};
+    std::uint64_t m_chunks{0};
+    std::uint64_t m_waits{0};
+    std::uint64_t m_wait_ns{0};
+    std::chrono::steady_clock::time_point m_start;
+    std::uint64_t m_elapsed_ns{0};
+
+    void write_member(member& m) {
+        std::vector<unsigned char> out = m.get();
+        m_next.write(reinterpret_cast<const char*>(out.data()), out.size());
+        m_bytes_out += out.size();
+    }
+
+    // Writes every member at the front of the queue that is already compressed.
+    void drain_ready() {
+        while (!m_in_flight.empty()
+               && m_in_flight.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            write_member(m_in_flight.front());
+            m_in_flight.pop_front();
+        }
+    }
+
+    void submit_chunk() {
+        if (m_chunk->empty()) return;
+        if (m_chunks == 0) m_start = std::chrono::steady_clock::now();
+        if (m_in_flight.size() >= m_max_in_flight) {
+            // The queue is full; wait for the oldest member.
+            auto start = std::chrono::steady_clock::now();
+            ++m_waits;
+            write_member(m_in_flight.front());
+            m_in_flight.pop_front();
+            m_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+        auto promise = std::make_shared<std::promise<std::vector<unsigned char>>>();
+        m_in_flight.push_back(promise->get_future());
+        std::shared_ptr<const std::vector<char>> chunk = std::move(m_chunk);
+        int level = m_level;
+        m_pool.submit([promise, chunk, level] {
+            try {
+                promise->set_value(compression::compress(chunk->data(), chunk->size(),
+                                                         compression::format::gzip, level));
+            } catch (...) {
+                promise->set_exception(std::current_exception());
+            }
+        });
+        ++m_chunks;
+        m_chunk = std::make_shared<std::vector<char>>();
+        m_chunk->reserve(m_chunk_size);
+    }
+
+public:
+    /**
+     * @param next Sink that receives the gzip members
+     * @param level Compression level, 0 to 9
+     * @param threads Number of compression threads
+     * @param chunk_size Bytes of input per gzip member
+     * @param max_in_flight Maximum number of chunks queued or being compressed.
+     *                      If zero, four per thread are allowed.
+     */
+    parallel_deflate_sink(sink& next, int level, std::size_t threads, std::size_t chunk_size,
+                          std::size_t max_in_flight = 0)
+        : stage(next), m_level(level), m_chunk_size(chunk_size ? chunk_size : 128 * 1024),
+          m_max_in_flight(max_in_flight ? max_in_flight : 4 * (threads ? threads : 1)),
+          m_chunk(std::make_shared<std::vector<char>>()), m_pool(threads) {
+        m_chunk->reserve(m_chunk_size);
+    }
+
+    void write(const char* data, std::size_t size) override {
+        m_bytes_in += size;
+        while (size > 0) {
+            std::size_t n = std::min(size, m_chunk_size - m_chunk->size());
+            m_chunk->insert(m_chunk->end(), data, data + n);
+            data += n;
+            size -= n;
+            if (m_chunk->size() == m_chunk_size) submit_chunk();
+        }
+        drain_ready();
+    }
+
+    void finish() override {
+        submit_chunk();
+        while (!m_in_flight.empty()) {
+            write_member(m_in_flight.front());
+            m_in_flight.pop_front();
+        }
+        if (m_chunks > 0) {
+            m_elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - m_start).count();
+        }
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".compress.threads", m_pool.size());
+        stats.add(prefix + ".compress.bytes_in", m_bytes_in);
+        stats.add(prefix + ".compress.bytes_out", m_bytes_out);
+        stats.add(prefix + ".compress.chunks", m_chunks);
+        stats.add(prefix + ".compress.queue_full_waits", m_waits);
+        stats.add(prefix + ".compress.queue_full_wait_ns", m_wait_ns);
+        if (m_elapsed_ns > 0) {
+            stats.add(prefix + ".compress.mb_per_sec", m_bytes_in * 1000 / m_elapsed_ns);
+        }
+        m_pool.report(stats, prefix + ".compress");
+    }
+};
+
+/**
+ * Source stage that transparently decompresses gzip or zlib input.
+ *
+ * The first bytes of the input are checked for a gzip or zlib header. If
+ * there is none, the input is passed through unchanged. Otherwise it is
+ * inflated as it is read; concatenated gzip members are decompressed one
+ * after the other, and bytes after the last member that do not start a new
+ * one (such as the padding at the end of a fixed-length data set) are
+ * ignored.
+ */
+class inflate_source : public source_stage {
+private:
+    enum class mode { detecting, passthrough, inflating, done };
+
+    z_stream m_stream{};
+    bool m_initialised{false};
+    mode m_mode{mode::detecting};
+    std::vector<unsigned char> m_in;
+    bool m_eof{false};
+    std::uint64_t m_bytes_in{0};
+    std::uint64_t m_bytes_out{0};
+    std::uint64_t m_members{0};
+    std::uint64_t m_ignored{0};
+
+    // Reads more input after the unconsumed bytes. Returns false at end of input.
+    bool fill() {
+        if (m_eof) return false;
+        if (m_stream.avail_in > 0) {
+            std::memmove(m_in.data(), m_stream.next_in, m_stream.avail_in);
+        }
+        std::size_t n = m_upstream.read(reinterpret_cast<char*>(m_in.data()) + m_stream.avail_in,
+                                        m_in.size() - m_stream.avail_in);
+        m_stream.next_in = m_in.data();
+        m_stream.avail_in += static_cast<uInt>(n);
+        m_bytes_in += n;
+        if (n == 0) m_eof = true;
+        return n > 0;
+    }
+
+    void detect() {
+        while (m_stream.avail_in < 2 && fill()) {}
+        if (m_stream.avail_in >= 2 && compression::is_compressed(m_stream.next_in)) {
+            // Window bits 15 + 32 accept both gzip and zlib headers.
+            int rc = inflateInit2(&m_stream, 15 + 32);
+            if (rc != Z_OK) compression::throw_zlib_error("inflateInit2()", rc, m_stream);
+            m_initialised = true;
+            m_mode = mode::inflating;
+            spdlog::debug("STDIN is compressed; decompressing");
+        } else {
+            m_mode = mode::passthrough;
+        }
+    }
+
+    // Called at the end of a member. Continues with the next one if there is one.
+    void next_member() {
+        ++m_members;
+        while (m_stream.avail_in < 2 && fill()) {}
+        if (m_stream.avail_in == 0) {
+            m_mode = mode::done;
+        } else if (m_stream.avail_in >= 2 && compression::is_compressed(m_stream.next_in)) {
+            inflateReset(&m_stream);
+        } else {
+            // Trailing data that is not a new member.
+            do {
+                m_ignored += m_stream.avail_in;
+                m_stream.avail_in = 0;
+            } while (fill());
+            spdlog::warn("Ignored {} bytes after the end of compressed STDIN", m_ignored);
+            m_mode = mode::done;
+        }
+    }
+
+public:
+    /**
+     * @param upstream Source of possibly compressed data
+     */
+    explicit inflate_source(source& upstream) : source_stage(upstream), m_in(64 * 1024) {
+        m_stream.next_in = m_in.data();
+    }
+
+    inflate_source(inflate_source const&) = delete;
+    inflate_source& operator=(inflate_source const&) = delete;
+
+    ~inflate_source() override {
+        if (m_initialised) inflateEnd(&m_stream);
+    }
+
+    std::size_t read(char* buffer, std::size_t size) override {
+        if (m_mode == mode::detecting) detect();
+        if (m_mode == mode::passthrough) {
+            if (m_stream.avail_in > 0) {
+                // Hand out the bytes read while detecting.
+                std::size_t n = std::min<std::size_t>(size, m_stream.avail_in);
+                std::memcpy(buffer, m_stream.next_in, n);
+                m_stream.next_in += n;
+                m_stream.avail_in -= static_cast<uInt>(n);
+                return n;
+            }
+            std::size_t n = m_upstream.read(buffer, size);
+            m_bytes_in += n;
+            return n;
+        }
+        while (m_mode == mode::inflating) {
+            if (m_stream.avail_in == 0 && !fill()) {
+                throw std::runtime_error("Compressed STDIN is truncated");
+            }
+            m_stream.next_out = reinterpret_cast<Bytef*>(buffer);
+            m_stream.avail_out = static_cast<uInt>(size);
+            int rc = ::inflate(&m_stream, Z_NO_FLUSH);
+            if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+                compression::throw_zlib_error("inflate()", rc, m_stream);
+            }
+            std::size_t n = size - m_stream.avail_out;
+            m_bytes_out += n;
+            if (rc == Z_STREAM_END) next_member();
+            if (n > 0) return n;
+        }
+        return 0;
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        if (!m_initialised) return;
+        stats.add(prefix + ".decompress.bytes_in", m_bytes_in);
+        stats.add(prefix + ".decompress.bytes_out", m_bytes_out);
+        stats.add(prefix + ".decompress.members", m_members);
+        stats.add(prefix + ".decompress.bytes_ignored", m_ignored);
+    }
+};
+
+} // namespace rkt
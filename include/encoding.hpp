@@ -0,0 +1,303 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "sink.hpp"
+
+namespace rkt::encoding {
+
+/**
+ * Character encodings recognised by the detector.
+ */
+enum class kind { unknown, ebcdic, ascii, utf8, binary };
+
+/**
+ * Returns a printable name for an encoding.
+ */
+inline const char* name(kind k) noexcept {
+    switch (k) {
+        case kind::ebcdic: return "ebcdic";
+        case kind::ascii: return "ascii";
+        case kind::utf8: return "utf8";
+        case kind::binary: return "binary";
+        default: return "unknown";
+    }
+}
+
+/**
+ * ISO8859-1 to IBM-1047 conversion table.
+ *
+ * Matches the z/OS UNIX convention where LF (0x0A) maps to NL (0x15).
+ */
+inline constexpr unsigned char iso8859_1_to_ibm1047[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x37, 0x2D, 0x2E, 0x2F, 0x16, 0x05, 0x15, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x3C, 0x3D, 0x32, 0x26, 0x18, 0x19, 0x3F, 0x27, 0x1C, 0x1D, 0x1E, 0x1F,
+    0x40, 0x5A, 0x7F, 0x7B, 0x5B, 0x6C, 0x50, 0x7D, 0x4D, 0x5D, 0x5C, 0x4E, 0x6B, 0x60, 0x4B, 0x61,
+    0xF0, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0x7A, 0x5E, 0x4C, 0x7E, 0x6E, 0x6F,
+    0x7C, 0xC1, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xD1, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6,
+    0xD7, 0xD8, 0xD9, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xAD, 0xE0, 0xBD, 0x5F, 0x6D,
+    0x79, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xC0, 0x4F, 0xD0, 0xA1, 0x07,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x06, 0x17, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x09, 0x0A, 0x1B,
+    0x30, 0x31, 0x1A, 0x33, 0x34, 0x35, 0x36, 0x08, 0x38, 0x39, 0x3A, 0x3B, 0x04, 0x14, 0x3E, 0xFF,
+    0x41, 0xAA, 0x4A, 0xB1, 0x9F, 0xB2, 0x6A, 0xB5, 0xBB, 0xB4, 0x9A, 0x8A, 0xB0, 0xCA, 0xAF, 0xBC,
+    0x90, 0x8F, 0xEA, 0xFA, 0xBE, 0xA0, 0xB6, 0xB3, 0x9D, 0xDA, 0x9B, 0x8B, 0xB7, 0xB8, 0xB9, 0xAB,
+    0x64, 0x65, 0x62, 0x66, 0x63, 0x67, 0x9E, 0x68, 0x74, 0x71, 0x72, 0x73, 0x78, 0x75, 0x76, 0x77,
+    0xAC, 0x69, 0xED, 0xEE, 0xEB, 0xEF, 0xEC, 0xBF, 0x80, 0xFD, 0xFE, 0xFB, 0xFC, 0xBA, 0xAE, 0x59,
+    0x44, 0x45, 0x42, 0x46, 0x43, 0x47, 0x9C, 0x48, 0x54, 0x51, 0x52, 0x53, 0x58, 0x55, 0x56, 0x57,
+    0x8C, 0x49, 0xCD, 0xCE, 0xCB, 0xCF, 0xCC, 0xE1, 0x70, 0xDD, 0xDE, 0xDB, 0xDC, 0x8D, 0x8E, 0xDF,
+};
+
+/** IBM-1047 substitute character, used for code points outside ISO8859-1. */
+inline constexpr unsigned char ibm1047_sub = 0x3F;
+
+/**
+ * Byte value histogram.
+ *
+ * Counting uses four interleaved tables so consecutive equal bytes do not
+ * serialise on the same counter; the tables are folded together on demand.
+ */
+class histogram {
+private:
+    std::uint32_t m_lanes[4][256] = {};
+    std::uint64_t m_total{0};
+
+public:
+    /**
+     * Counts every byte in the buffer.
+     *
+     * @param data Source buffer
+     * @param size Number of bytes in the buffer
+     */
+    void add(const unsigned char* data, std::size_t size) noexcept {
+        std::size_t i = 0;
+        for (; i + 4 <= size; i += 4) {
+            ++m_lanes[0][data[i]];
+            ++m_lanes[1][data[i + 1]];
+            ++m_lanes[2][data[i + 2]];
+            ++m_lanes[3][data[i + 3]];
+        }
+        for (; i < size; ++i) ++m_lanes[0][data[i]];
+        m_total += size;
+    }
+
+    /** Returns the number of occurrences of byte b. */
+    std::uint64_t count(unsigned char b) const noexcept {
+        return std::uint64_t{m_lanes[0][b]} + m_lanes[1][b] + m_lanes[2][b] + m_lanes[3][b];
+    }
+
+    /** Returns the sum of counts for bytes in [lo, hi]. */
+    std::uint64_t count(unsigned char lo, unsigned char hi) const noexcept {
+        std::uint64_t n = 0;
+        for (unsigned b = lo; b <= hi; ++b) n += count(static_cast<unsigned char>(b));
+        return n;
+    }
+
+    /** Returns the number of bytes counted. */
+    std::uint64_t total() const noexcept { return m_total; }
+};
+
+/**
+ * Checks whether a buffer is well formed UTF-8.
+ *
+ * A multi-byte sequence truncated by the end of the buffer is accepted
+ * because the buffer is normally a sample cut from a longer stream.
+ */
+inline bool is_utf8(const unsigned char* data, std::size_t size) noexcept {
+    std::size_t i = 0;
+    while (i < size) {
+        unsigned char b = data[i];
+        std::size_t len;
+        if (b < 0x80) { ++i; continue; }
+        else if ((b & 0xE0) == 0xC0 && b >= 0xC2) len = 2;
+        else if ((b & 0xF0) == 0xE0) len = 3;
+        else if ((b & 0xF8) == 0xF0 && b <= 0xF4) len = 4;
+        else return false;
+        for (std::size_t j = 1; j < len; ++j) {
+            if (i + j >= size) return true;
+            if ((data[i + j] & 0xC0) != 0x80) return false;
+        }
+        i += len;
+    }
+    return true;
+}
+
+/**
+ * Classifies a sample of text.
+ *
+ * ASCII and EBCDIC text are told apart by their space, new line, letter and
+ * digit code points, which do not overlap between the two code pages. The
+ * sample is then classified as binary if it contains NUL bytes, too many
+ * control characters of the winning code page, or too little text. ASCII
+ * text containing bytes above 0x7F is classified as UTF-8 when it is well
+ * formed.
+ *
+ * @param h Histogram of the sample
+ * @param sample The sample itself, used for UTF-8 validation
+ * @param size Number of bytes in the sample
+ * @return the detected encoding, or kind::unknown for an empty sample
+ */
+inline kind classify(const histogram& h, const unsigned char* sample, std::size_t size) noexcept {
+    const std::uint64_t total = h.total();
+    if (total == 0) return kind::unknown;
+    if (h.count(0x00) * 100 > total) return kind::binary;
+
+    const std::uint64_t ascii = h.count(0x20) + h.count(0x0A) + h.count(0x0D) + h.count(0x09)
+        + h.count(0x30, 0x39) + h.count(0x41, 0x5A) + h.count(0x61, 0x7A);
+    const std::uint64_t ebcdic = h.count(0x40) + h.count(0x15) + h.count(0x25) + h.count(0x05)
+        + h.count(0xF0, 0xF9) + h.count(0x81, 0x89) + h.count(0x91, 0x99) + h.count(0xA2, 0xA9)
+        + h.count(0xC1, 0xC9) + h.count(0xD1, 0xD9) + h.count(0xE2, 0xE9);
+
+    if (ebcdic > ascii) {
+        // Everything below the EBCDIC space except HT, CR, NL and LF is a control.
+        const std::uint64_t controls = h.count(0x00, 0x3F)
+            - h.count(0x05) - h.count(0x0D) - h.count(0x15) - h.count(0x25);
+        if (controls * 20 > total || ebcdic * 4 < total) return kind::binary;
+        return kind::ebcdic;
+    }
+    const std::uint64_t controls = h.count(0x00, 0x1F) + h.count(0x7F)
+        - h.count(0x09) - h.count(0x0A) - h.count(0x0D);
+    if (controls * 20 > total || ascii * 4 < total) return kind::binary;
+    if (h.count(0x80, 0xFF) > 0 && is_utf8(sample, size)) return kind::utf8;
+    return kind::ascii;
+}
+
+} // namespace rkt::encoding
+
+namespace rkt {
+
+/**
+ * Relay stage that detects the encoding of a stream and converts it to IBM-1047.
+ *
+ * The first sample_size bytes of the stream are held back and classified
+ * using a byte histogram. EBCDIC and binary streams are then passed through
+ * unchanged. ASCII streams are converted as ISO8859-1 and UTF-8 streams are
+ * decoded with code points above U+00FF replaced by the EBCDIC substitute
+ * character. Detection runs once per stream so its cost is bounded by the
+ * sample size.
+ */
+class encoding_stage : public stage {
+private:
+    std::size_t m_sample_size;
+    std::vector<char> m_buffer;
+    encoding::kind m_kind{encoding::kind::unknown};
+    bool m_detected{false};
+    std::uint64_t m_detect_ns{0};
+    std::uint64_t m_converted{0};
+    // UTF-8 decoder state carried between chunks.
+    std::uint32_t m_code_point{0};
+    int m_pending{0};
+
+    void detect() {
+        auto start = std::chrono::steady_clock::now();
+        const auto* sample = reinterpret_cast<const unsigned char*>(m_buffer.data());
+        encoding::histogram h;
+        h.add(sample, m_buffer.size());
+        m_kind = encoding::classify(h, sample, m_buffer.size());
+        m_detected = true;
+        m_detect_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        spdlog::debug("Detected {} encoding in {} byte sample", encoding::name(m_kind), m_buffer.size());
+    }
+
+    void emit_utf8(unsigned char b, std::string& out) {
+        if (m_pending > 0) {
+            if ((b & 0xC0) == 0x80) {
+                m_code_point = (m_code_point << 6) | (b & 0x3F);
+                if (--m_pending == 0) {
+                    out.push_back(static_cast<char>(m_code_point <= 0xFF
+                        ? encoding::iso8859_1_to_ibm1047[m_code_point] : encoding::ibm1047_sub));
+                }
+                return;
+            }
+            // Truncated sequence; substitute and decode b afresh.
+            m_pending = 0;
+            out.push_back(static_cast<char>(encoding::ibm1047_sub));
+        }
+        if (b < 0x80) {
+            out.push_back(static_cast<char>(encoding::iso8859_1_to_ibm1047[b]));
+        } else if ((b & 0xE0) == 0xC0) {
+            m_code_point = b & 0x1F;
+            m_pending = 1;
+        } else if ((b & 0xF0) == 0xE0) {
+            m_code_point = b & 0x0F;
+            m_pending = 2;
+        } else if ((b & 0xF8) == 0xF0) {
+            m_code_point = b & 0x07;
+            m_pending = 3;
+        } else {
+            out.push_back(static_cast<char>(encoding::ibm1047_sub));
+        }
+    }
+
+    void forward(const char* data, std::size_t size) {
+        if (size == 0) return;
+        if (m_kind != encoding::kind::ascii && m_kind != encoding::kind::utf8) {
+            m_next.write(data, size);
+            return;
+        }
+        std::string out;
+        out.reserve(size);
+        const auto* in = reinterpret_cast<const unsigned char*>(data);
+        if (m_kind == encoding::kind::ascii) {
+            out.resize(size);
+            for (std::size_t i = 0; i < size; ++i) {
+                out[i] = static_cast<char>(encoding::iso8859_1_to_ibm1047[in[i]]);
+            }
+        } else {
+            for (std::size_t i = 0; i < size; ++i) emit_utf8(in[i], out);
+        }
+        m_converted += size;
+        m_next.write(out.data(), out.size());
+    }
+
+public:
+    /**
+     * @param next Sink that receives the converted stream
+     * @param sample_size Number of bytes to sample before classifying
+     */
+    encoding_stage(sink& next, std::size_t sample_size)
+        : stage(next), m_sample_size(sample_size) {
+        m_buffer.reserve(sample_size);
+    }
+
+    void write(const char* data, std::size_t size) override {
+        if (!m_detected) {
+            std::size_t take = std::min(size, m_sample_size - m_buffer.size());
+            m_buffer.insert(m_buffer.end(), data, data + take);
+            data += take;
+            size -= take;
+            if (m_buffer.size() < m_sample_size) return;
+            detect();
+            forward(m_buffer.data(), m_buffer.size());
+            m_buffer = std::vector<char>();
+        }
+        forward(data, size);
+    }
+
+    void finish() override {
+        if (!m_detected) {
+            detect();
+            forward(m_buffer.data(), m_buffer.size());
+        }
+        if (m_pending > 0) {
+            std::string sub(1, static_cast<char>(encoding::ibm1047_sub));
+            m_pending = 0;
+            m_next.write(sub.data(), sub.size());
+        }
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".encoding", encoding::name(m_kind));
+        stats.add(prefix + ".encoding.detect_ns", m_detect_ns);
+        stats.add(prefix + ".encoding.converted_bytes", m_converted);
+    }
+};
+
+} // namespace rkt
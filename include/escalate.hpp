@@ -0,0 +1,189 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include "file.hpp"
+#include "filter.hpp"
+#include "framing.hpp"
+#include "sink.hpp"
+
+namespace rkt {
+
+/**
+ * Return code escalation driven by the program's output.
+ *
+ * Each rule pairs a line pattern with a minimum return code and,
+ * optionally, a stop action. When a line matches, the step's return code
+ * is raised to at least the rule's value; a stop rule also calls the stop
+ * action once, which normally terminates the program. One escalator is
+ * shared by the scan stages of STDOUT and STDERR.
+ *
+ * This class is not thread safe.
+ */
+class rc_escalator {
+private:
+    struct rule {
+        int rc;
+        bool stop;
+        std::uint64_t hits;
+    };
+
+    pattern_set m_patterns;
+    std::vector<rule> m_rules;
+    std::function<void()> m_on_stop;
+    int m_rc{0};
+    bool m_stopped{false};
+
+public:
+    /** Largest return code a rule may set. */
+    static constexpr int max_rc = 4095;
+
+    /**
+     * Adds a rule.
+     *
+     * @param pattern Literal, or "re:" followed by a regular expression
+     * @param rc Minimum return code when the pattern matches
+     * @param stop Also stop the program
+     */
+    void add(const std::string& pattern, int rc, bool stop) {
+        if (rc < 0 || rc > max_rc) throw std::invalid_argument(fmt::format("Return code {} is out of range", rc));
+        m_patterns.add(pattern);
+        m_rules.push_back({rc, stop, 0});
+    }
+
+    /**
+     * Reads rules from a file, one per line, and builds the rule table.
+     *
+     * Each line is "rc=N PATTERN" to raise the return code to at least N,
+     * or "stop=N PATTERN" to also stop the program. Trailing blanks are
+     * removed. Empty lines and lines starting with "#" are ignored.
+     *
+     * @param name Path or DD name of the file, e.g. "//DD:RCRULES"
+     * @throws std::runtime_error if the file cannot be read or a rule is malformed
+     */
+    void load(const std::string& name) {
+        file f(name, "r");
+        FILE* fp = static_cast<FILE*>(f);
+        char line[4096];
+        while (std::fgets(line, sizeof(line), fp)) {
+            std::string text(line);
+            while (!text.empty() && (text.back() == '\n' || text.back() == ' ')) text.pop_back();
+            if (text.empty() || text[0] == '#') continue;
+            const bool stop = text.rfind("stop=", 0) == 0;
+            if (!stop && text.rfind("rc=", 0) != 0) {
+                throw std::runtime_error("Return code rule must start with rc= or stop=: " + text);
+            }
+            const std::size_t blank = text.find(' ');
+            if (blank == std::string::npos || blank + 1 == text.size()) {
+                throw std::runtime_error("Return code rule has no pattern: " + text);
+            }
+            const std::size_t equals = text.find('=');
+            int rc;
+            try {
+                rc = std::stoi(text.substr(equals + 1, blank - equals - 1));
+            } catch (const std::logic_error&) {
+                throw std::runtime_error("Return code rule has an invalid return code: " + text);
+            }
+            add(text.substr(blank + 1), rc, stop);
+        }
+        if (m_rules.empty()) throw std::runtime_error(name + " contains no return code rules");
+        m_patterns.build();
+    }
+
+    /** Sets the action called the first time a stop rule matches, or clears it if empty. */
+    void on_stop(std::function<void()> action) { m_on_stop = std::move(action); }
+
+    /**
+     * Matches a line against the rules and applies the matching rule.
+     *
+     * @param stream Name of the stream the line came from, for the log
+     * @param line Line without its new line
+     */
+    void scan(const std::string& stream, std::string_view line) {
+        bool prefiltered;
+        const std::size_t index = m_patterns.match(line, prefiltered);
+        if (index == pattern_set::npos) return;
+        rule& r = m_rules[index];
+        if (r.hits++ == 0) {
+            spdlog::warn("{} matched return code rule {} ({}): {}", stream, index + 1, m_patterns.text(index), line);
+        }
+        if (r.rc > m_rc) m_rc = r.rc;
+        if (r.stop && !m_stopped) {
+            m_stopped = true;
+            if (m_on_stop) {
+                spdlog::warn("Stopping the program: {} matched stop rule {}", stream, index + 1);
+                m_on_stop();
+            }
+        }
+    }
+
+    /** Returns the highest return code set by a matching rule, or 0. */
+    int rc() const noexcept { return m_rc; }
+
+    /** Returns true if a stop rule matched. */
+    bool stopped() const noexcept { return m_stopped; }
+
+    /** Adds the hits of every rule to the step statistics. */
+    void report(statistics& stats) const {
+        stats.add("RC.escalated", m_rc);
+        for (std::size_t i = 0; i < m_rules.size(); ++i) {
+            stats.add(fmt::format("RC.rule.{}", i + 1), fmt::format("{} {}", m_rules[i].hits, m_patterns.text(i)));
+        }
+    }
+};
+
+/**
+ * Stage that scans lines for return code rules.
+ *
+ * Lines are matched where they lie in the relayed chunk, which is then
+ * forwarded unchanged, so scanning adds no copy; only a line that spans
+ * two reads is assembled by the line framer.
+ */
+class escalate_stage : public stage {
+private:
+    rc_escalator& m_escalator;
+    std::string m_stream;
+    line_framer m_framer;
+    bool m_continuation{false};
+
+    void on_line(std::string_view line, bool terminated) {
+        // Only the first piece of an overlong line is scanned.
+        if (!m_continuation) m_escalator.scan(m_stream, line);
+        m_continuation = !terminated;
+    }
+
+public:
+    /**
+     * @param next Sink that receives the unchanged data
+     * @param escalator Shared rule table and return code
+     * @param stream Stream name used in log messages, e.g. "STDOUT"
+     */
+    escalate_stage(sink& next, rc_escalator& escalator, std::string stream)
+        : stage(next), m_escalator(escalator), m_stream(std::move(stream)) {}
+
+    void write(const char* data, std::size_t size) override {
+        m_framer.feed(data, size, [this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        m_next.write(data, size);
+    }
+
+    void finish() override {
+        m_framer.flush([this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        m_framer.report(stats, prefix + ".escalate");
+    }
+};
+
+} // namespace rkt
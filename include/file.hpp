@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cctype>
 #include <cstdio>
 #include <string>
+#include <string_view>
 
 #include "errors.hpp"
 
@@ -225,4 +227,39 @@ public:
     }
 };
 
+/**
+ * Returns the name a data set is opened with: "//DD:NAME" for a DD name
+ * given bare or as "//DD:NAME", in upper case since DD names are not case
+ * sensitive, or a path name unchanged. Two names refer to the same data
+ * set if this returns the same for both.
+ *
+ * @param name DD name, "//DD:" name or path name
+ */
+inline std::string data_set_name(const std::string& name) {
+    const bool dd = name.find('/') == std::string::npos;
+    if (!dd && (name.size() < 5 || name.compare(0, 2, "//") != 0
+                || std::toupper(static_cast<unsigned char>(name[2])) != 'D'
+                || std::toupper(static_cast<unsigned char>(name[3])) != 'D' || name[4] != ':')) {
+        return name;
+    }
+    std::string result = "//DD:";
+    for (char c : std::string_view(name).substr(dd ? 0 : 5)) {
+        result.push_back(static_cast<char>(std::toupper(static_cast<unsigned char>(c))));
+    }
+    return result;
+}
+
+/**
+ * Returns true if a name is one of the DD names the step itself reads or
+ * writes, STDIN, STDOUT, STDERR or SYSOUT, in any form data_set_name()
+ * accepts. Opening one of them for output again would truncate the data
+ * set the relay is using.
+ *
+ * @param name DD name, "//DD:" name or path name
+ */
+inline bool is_step_dd(const std::string& name) {
+    const std::string opened = data_set_name(name);
+    return opened == "//DD:STDIN" || opened == "//DD:STDOUT" || opened == "//DD:STDERR" || opened == "//DD:SYSOUT";
+}
+
 }
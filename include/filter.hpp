@@ -0,0 +1,249 @@
+#pragma once
+
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <regex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "aho_corasick.hpp"
+#include "file.hpp"
+#include "framing.hpp"
+#include "sink.hpp"
+
+namespace rkt {
+
+/**
+ * Set of literal and regular expression line patterns.
+ *
+ * Literals are compiled into one Aho-Corasick automaton. Before a line is
+ * scanned it goes through a prefilter: every literal contains at least one
+ * of a few "rare" bytes (the least common class of character in the
+ * literal - punctuation, then upper case, digits, lower case and blank),
+ * and when there are at most max_prefilter_bytes of them a line that
+ * contains none of them is rejected with memchr, which runs at memory
+ * bandwidth. Regular expressions use std::regex and are only tried on
+ * lines that no literal matched.
+ *
+ * A pattern set is immutable once loaded and can be shared by several
+ * filter stages.
+ */
+class pattern_set {
+public:
+    /** Index returned when no pattern matches. */
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    /** Largest number of rare bytes searched by the prefilter. */
+    static constexpr std::size_t max_prefilter_bytes = 3;
+
+private:
+    std::vector<std::string> m_texts;
+    aho_corasick m_literals;
+    std::vector<std::pair<std::size_t, std::regex>> m_regexes;
+    std::vector<unsigned char> m_rare;
+
+    // Higher is rarer in ordinary text.
+    static int rarity(unsigned char c) {
+        if (c == ' ') return 0;
+        if (std::islower(c)) return 1;
+        if (std::isdigit(c)) return 2;
+        if (std::isupper(c)) return 3;
+        return 4;
+    }
+
+    void add_rare_byte(std::string_view literal) {
+        unsigned char best = static_cast<unsigned char>(literal[0]);
+        for (unsigned char c : literal) {
+            if (rarity(c) > rarity(best)) best = c;
+        }
+        if (std::memchr(m_rare.data(), best, m_rare.size()) == nullptr) m_rare.push_back(best);
+    }
+
+    bool may_contain_literal(std::string_view line) const noexcept {
+        if (m_rare.size() > max_prefilter_bytes) return true;
+        for (unsigned char c : m_rare) {
+            if (std::memchr(line.data(), c, line.size())) return true;
+        }
+        return false;
+    }
+
+public:
+    /**
+     * Adds a pattern.
+     *
+     * A pattern starting with "re:" is a regular expression (ECMAScript
+     * syntax) that matches anywhere in a line; otherwise the pattern is a
+     * literal that matches anywhere in a line.
+     *
+     * @param text Pattern text
+     * @throws std::invalid_argument if the pattern is empty or an invalid
+     *         regular expression
+     */
+    void add(const std::string& text) {
+        const std::size_t index = m_texts.size();
+        if (text.rfind("re:", 0) == 0) {
+            try {
+                m_regexes.emplace_back(index, std::regex(text.substr(3), std::regex::ECMAScript | std::regex::optimize));
+            } catch (const std::regex_error& e) {
+                throw std::invalid_argument("Invalid regular expression " + text + ": " + e.what());
+            }
+        } else {
+            if (text.empty()) throw std::invalid_argument("Empty pattern");
+            m_literals.add(text, static_cast<std::uint32_t>(index));
+            add_rare_byte(text);
+        }
+        m_texts.push_back(text);
+    }
+
+    /**
+     * Prepares the set for matching. Must be called after the last add().
+     */
+    void build() { m_literals.build(); }
+
+    /**
+     * Reads patterns from a file, one per line, and builds the set.
+     *
+     * Trailing blanks are removed, so patterns may be kept in a fixed-length
+     * data set. Empty lines and lines starting with "#" are ignored.
+     *
+     * @param name Path or DD name of the file, e.g. "//DD:FILTER"
+     * @return the built pattern set
+     * @throws std::runtime_error if the file cannot be read or holds no patterns
+     */
+    static std::shared_ptr<const pattern_set> load(const std::string& name) {
+        auto set = std::make_shared<pattern_set>();
+        file f(name, "r");
+        FILE* fp = static_cast<FILE*>(f);
+        char line[4096];
+        while (std::fgets(line, sizeof(line), fp)) {
+            std::string text(line);
+            while (!text.empty() && (text.back() == '\n' || text.back() == ' ')) text.pop_back();
+            if (text.empty() || text[0] == '#') continue;
+            set->add(text);
+        }
+        if (set->size() == 0) throw std::runtime_error(name + " contains no patterns");
+        set->build();
+        return set;
+    }
+
+    /** Returns the number of patterns. */
+    std::size_t size() const noexcept { return m_texts.size(); }
+
+    /** Returns the text of a pattern as it was added. */
+    const std::string& text(std::size_t index) const { return m_texts[index]; }
+
+    /** Returns the number of bytes searched by the prefilter, or 0 if it is not used. */
+    std::size_t prefilter_bytes() const noexcept {
+        return m_rare.size() <= max_prefilter_bytes ? m_rare.size() : 0;
+    }
+
+    /**
+     * Matches a line.
+     *
+     * @param line Line without its new line
+     * @param prefiltered Set to true if the prefilter rejected the line
+     * @return index of the matching pattern, or npos. When several literals
+     *         match, the one that ends first wins.
+     */
+    std::size_t match(std::string_view line, bool& prefiltered) const {
+        prefiltered = false;
+        if (!m_literals.empty()) {
+            if (may_contain_literal(line)) {
+                std::uint32_t id = m_literals.find(line.data(), line.size());
+                if (id != aho_corasick::no_match) return id;
+            } else {
+                prefiltered = true;
+            }
+        }
+        for (const auto& [index, re] : m_regexes) {
+            if (std::regex_search(line.begin(), line.end(), re)) return index;
+        }
+        return npos;
+    }
+};
+
+/**
+ * Stage that drops or keeps lines matching a pattern set.
+ *
+ * In drop mode matching lines are removed from the stream; in keep mode
+ * only matching lines are passed on. Lines are framed with line_framer, so
+ * a line that spans reads is matched as a whole, and a line longer than
+ * the framing limit is matched on its first piece. The lines kept from one
+ * chunk are forwarded with one write.
+ */
+class filter_stage : public stage {
+private:
+    std::shared_ptr<const pattern_set> m_patterns;
+    bool m_keep;
+    line_framer m_framer;
+    std::string m_batch;
+    bool m_continuation{false};
+    bool m_pass{true};
+    std::vector<std::uint64_t> m_hits;
+    std::uint64_t m_lines{0};
+    std::uint64_t m_dropped{0};
+    std::uint64_t m_prefiltered{0};
+
+    void on_line(std::string_view line, bool terminated) {
+        // The pieces of an overlong line share the decision made for the first piece.
+        if (!m_continuation) {
+            ++m_lines;
+            bool prefiltered;
+            std::size_t index = m_patterns->match(line, prefiltered);
+            if (prefiltered) ++m_prefiltered;
+            if (index != pattern_set::npos) ++m_hits[index];
+            m_pass = (index != pattern_set::npos) == m_keep;
+            if (!m_pass) ++m_dropped;
+        }
+        m_continuation = !terminated;
+        if (!m_pass) return;
+        m_batch.append(line);
+        if (terminated) m_batch.push_back('\n');
+    }
+
+    void forward() {
+        if (m_batch.empty()) return;
+        m_next.write(m_batch.data(), m_batch.size());
+        m_batch.clear();
+    }
+
+public:
+    /**
+     * @param next Sink that receives the lines that pass
+     * @param patterns Pattern set to match
+     * @param keep Pass only matching lines instead of dropping them
+     */
+    filter_stage(sink& next, std::shared_ptr<const pattern_set> patterns, bool keep)
+        : stage(next), m_patterns(std::move(patterns)), m_keep(keep), m_hits(m_patterns->size(), 0) {
+        m_batch.reserve(8 * 1024);
+    }
+
+    void write(const char* data, std::size_t size) override {
+        m_framer.feed(data, size, [this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        forward();
+    }
+
+    void finish() override {
+        m_framer.flush([this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        forward();
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".filter.lines", m_lines);
+        stats.add(prefix + ".filter.lines_dropped", m_dropped);
+        stats.add(prefix + ".filter.lines_prefiltered", m_prefiltered);
+        for (std::size_t i = 0; i < m_hits.size(); ++i) {
+            stats.add(fmt::format("{}.filter.hits.{}", prefix, i + 1), fmt::format("{} {}", m_hits[i], m_patterns->text(i)));
+        }
+    }
+};
+
+} // namespace rkt
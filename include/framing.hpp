@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "statistics.hpp"
+
+namespace rkt {
+
+/**
+ * Finds the next new line character.
+ *
+ * Delegates to memchr, which the C runtime implements with vector
+ * instructions (SRST or the vector facility on z/OS, SSE/AVX elsewhere),
+ * so the scan runs at memory bandwidth rather than a byte at a time.
+ *
+ * @param begin Start of the range to scan
+ * @param end End of the range to scan
+ * @return pointer to the first new line, or end if there is none
+ */
+inline const char* find_newline(const char* begin, const char* end) noexcept {
+    const void* nl = std::memchr(begin, '\n', static_cast<std::size_t>(end - begin));
+    return nl ? static_cast<const char*>(nl) : end;
+}
+
+/**
+ * Splits relayed chunks into lines.
+ *
+ * Chunks are fed in the order they are read. Each complete line is handed
+ * to a callback as a string_view without its new line. Lines that lie
+ * wholly inside a chunk refer directly to the chunk, so they are not copied;
+ * only a line that spans chunks is assembled in a carry buffer. A line
+ * longer than the maximum line length is handed out in pieces of that
+ * length, so the carry buffer never grows beyond it.
+ *
+ * Views are only valid for the duration of the callback.
+ *
+ * This class is not thread safe.
+ */
+class line_framer {
+private:
+    std::size_t m_max_line;
+    std::string m_carry;
+    std::uint64_t m_lines{0};
+    std::uint64_t m_carried{0};
+    std::uint64_t m_split{0};
+
+public:
+    /** Default maximum line length. */
+    static constexpr std::size_t default_max_line = 64 * 1024;
+
+    /**
+     * @param max_line Maximum line length, must be positive
+     */
+    explicit line_framer(std::size_t max_line = default_max_line)
+        : m_max_line(max_line ? max_line : default_max_line) {
+        m_carry.reserve(256);
+    }
+
+    /**
+     * Splits a chunk into lines.
+     *
+     * @param data Source buffer
+     * @param size Number of bytes in the buffer
+     * @param on_line Callable invoked as on_line(std::string_view line, bool terminated)
+     *                for each line. terminated is false when the line was not ended
+     *                by a new line, i.e. for the leading pieces of an overlong line.
+     */
+    template <typename F>
+    void feed(const char* data, std::size_t size, F&& on_line) {
+        const char* end = data + size;
+        while (data < end) {
+            const char* nl = find_newline(data, end);
+            if (!m_carry.empty()) {
+                // Complete, or extend, the line started in an earlier chunk.
+                std::size_t room = m_max_line - m_carry.size();
+                if (static_cast<std::size_t>(nl - data) > room) {
+                    m_carry.append(data, room);
+                    data += room;
+                    ++m_split;
+                    on_line(std::string_view(m_carry), false);
+                    m_carry.clear();
+                    continue;
+                }
+                m_carry.append(data, nl - data);
+                if (nl == end) return;
+                ++m_lines;
+                ++m_carried;
+                on_line(std::string_view(m_carry), true);
+                m_carry.clear();
+                data = nl + 1;
+                continue;
+            }
+            if (static_cast<std::size_t>(nl - data) > m_max_line) {
+                ++m_split;
+                on_line(std::string_view(data, m_max_line), false);
+                data += m_max_line;
+                continue;
+            }
+            if (nl == end) {
+                m_carry.assign(data, end - data);
+                return;
+            }
+            ++m_lines;
+            on_line(std::string_view(data, nl - data), true);
+            data = nl + 1;
+        }
+    }
+
+    /**
+     * Hands out a final line that has no new line, if any.
+     *
+     * The line is handed out with terminated set to false.
+     *
+     * @param on_line Callable invoked as on_line(std::string_view line, bool terminated)
+     */
+    template <typename F>
+    void flush(F&& on_line) {
+        if (m_carry.empty()) return;
+        ++m_lines;
+        on_line(std::string_view(m_carry), false);
+        m_carry.clear();
+    }
+
+    /** Returns the number of bytes held for an incomplete line. */
+    std::size_t pending() const noexcept { return m_carry.size(); }
+
+    /**
+     * Adds the framing counters to the step statistics.
+     *
+     * @param stats Statistics to add to
+     * @param prefix Name of the stream and stage, e.g. "STDOUT.filter"
+     */
+    void report(statistics& stats, const std::string& prefix) const {
+        stats.add(prefix + ".lines", m_lines);
+        stats.add(prefix + ".lines_spanning_reads", m_carried);
+        stats.add(prefix + ".lines_split", m_split);
+    }
+};
+
+} // namespace rkt
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "errors.hpp"
+#include "sink.hpp"
+
+namespace rkt {
+
+/**
+ * Stage that holds a stream back until the step's outcome is known.
+ *
+ * Data is collected in a memory buffer of a fixed size. When the buffer is
+ * full it is appended to a temporary file in one write and reused, so
+ * memory use stays at the buffer size however much is held. When the
+ * stream ends nothing is forwarded: the owner calls release() to forward
+ * everything that was held, or discard() to drop it, and either one
+ * finishes the rest of the pipeline.
+ */
+class hold_stage : public stage {
+private:
+    std::size_t m_capacity;
+    std::string m_buffer;
+    std::unique_ptr<FILE, int (*)(FILE*)> m_spill{nullptr, &std::fclose};
+    std::uint64_t m_bytes{0};
+    std::uint64_t m_spilled{0};
+    bool m_released{false};
+    bool m_settled{false};
+
+    void spill() {
+        if (m_buffer.empty()) return;
+        if (!m_spill) {
+            m_spill.reset(std::tmpfile());
+            if (!m_spill) throwError("Error creating a temporary file");
+        }
+        if (std::fwrite(m_buffer.data(), 1, m_buffer.size(), m_spill.get()) != m_buffer.size()) {
+            throwError("Error writing to a temporary file");
+        }
+        m_spilled += m_buffer.size();
+        m_buffer.clear();
+    }
+
+public:
+    /**
+     * @param next Sink that receives the data if it is released
+     * @param capacity Bytes held in memory before they are written to a temporary file
+     */
+    hold_stage(sink& next, std::size_t capacity) : stage(next), m_capacity(capacity ? capacity : 64 * 1024) {
+        m_buffer.reserve(m_capacity);
+    }
+
+    void write(const char* data, std::size_t size) override {
+        m_bytes += size;
+        while (size > 0) {
+            const std::size_t n = std::min(size, m_capacity - m_buffer.size());
+            m_buffer.append(data, n);
+            data += n;
+            size -= n;
+            if (m_buffer.size() == m_capacity) spill();
+        }
+    }
+
+    /** Keeps the held data; the stream is finished by release() or discard(). */
+    void finish() override {}
+
+    /** Forwards everything that was held and finishes the rest of the pipeline. */
+    void release() {
+        m_settled = true;
+        if (m_spill) {
+            spill();
+            std::rewind(m_spill.get());
+            std::vector<char> chunk(64 * 1024);
+            std::size_t n;
+            while ((n = std::fread(chunk.data(), 1, chunk.size(), m_spill.get())) > 0) m_next.write(chunk.data(), n);
+            if (std::ferror(m_spill.get())) throwError("Error reading a temporary file");
+            m_spill.reset();
+        } else if (!m_buffer.empty()) {
+            m_next.write(m_buffer.data(), m_buffer.size());
+        }
+        m_buffer.clear();
+        m_released = true;
+        stage::finish();
+    }
+
+    /** Drops everything that was held and finishes the rest of the pipeline. */
+    void discard() {
+        m_settled = true;
+        m_spill.reset();
+        m_buffer.clear();
+        m_buffer.shrink_to_fit();
+        stage::finish();
+    }
+
+    /** Returns true once release() or discard() has been called. */
+    bool settled() const noexcept { return m_settled; }
+
+    /** Returns the number of bytes written to the stage. */
+    std::uint64_t bytes() const noexcept { return m_bytes; }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".hold.bytes", m_bytes);
+        stats.add(prefix + ".hold.spilled_bytes", m_spilled);
+        stats.add(prefix + ".hold.released", m_released ? 1 : 0);
+    }
+};
+
+} // namespace rkt
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "spdlog/fmt/fmt.h"
+
+#include "file.hpp"
+#include "framing.hpp"
+#include "route.hpp"
+#include "sink.hpp"
+
+namespace rkt::json {
+
+/** Skips blanks, tabs and carriage returns. */
+inline const char* skip_space(const char* p, const char* end) noexcept {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+    return p;
+}
+
+/**
+ * Finds the closing quote of a string.
+ *
+ * Quotes are found with memchr, so the bytes of a string are not looked
+ * at one by one; only the backslashes in front of a quote are counted to
+ * tell an escaped quote from the closing one.
+ *
+ * @param p First byte after the opening quote
+ * @param end End of the line
+ * @return pointer to the closing quote, or end if there is none
+ */
+inline const char* string_end(const char* p, const char* end) noexcept {
+    const char* begin = p;
+    while (p < end) {
+        const auto* q = static_cast<const char*>(std::memchr(p, '"', static_cast<std::size_t>(end - p)));
+        if (!q) return end;
+        std::size_t backslashes = 0;
+        for (const char* b = q; b > begin && b[-1] == '\\'; --b) ++backslashes;
+        if (backslashes % 2 == 0) return q;
+        p = q + 1;
+    }
+    return end;
+}
+
+/**
+ * Skips an object or array.
+ *
+ * @param p Opening brace or bracket
+ * @param end End of the line
+ * @return pointer after the closing brace or bracket, or nullptr if it is missing
+ */
+inline const char* skip_nested(const char* p, const char* end) noexcept {
+    int depth = 0;
+    for (; p < end; ++p) {
+        switch (*p) {
+            case '"':
+                p = string_end(p + 1, end);
+                if (p == end) return nullptr;
+                break;
+            case '{': case '[':
+                ++depth;
+                break;
+            case '}': case ']':
+                if (--depth == 0) return p + 1;
+                break;
+            default:
+                break;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Extracts the values of top-level fields from a line holding a JSON object.
+ *
+ * No document is built: the object is scanned once, nested values are
+ * skipped, and scanning stops as soon as every requested field has been
+ * found, so the rest of the line is not validated. String values are
+ * returned without their quotes and with escapes left as they are; other
+ * values are returned as written, e.g. 42 or true. A field that is not
+ * present has a value with a null data().
+ *
+ * @param line Line without its new line
+ * @param fields Names of the fields to extract
+ * @param values Receives one value per field
+ * @return false if the line is not a JSON object
+ */
+inline bool extract(std::string_view line, const std::vector<std::string>& fields,
+                    std::vector<std::string_view>& values) {
+    values.assign(fields.size(), std::string_view{});
+    const char* p = line.data();
+    const char* end = p + line.size();
+    p = skip_space(p, end);
+    if (p == end || *p != '{') return false;
+    std::size_t found = 0;
+    ++p;
+    while (true) {
+        p = skip_space(p, end);
+        if (p == end) return false;
+        if (*p == '}') return true;
+        if (*p != '"') return false;
+        const char* key_end = string_end(p + 1, end);
+        if (key_end == end) return false;
+        const std::string_view key(p + 1, static_cast<std::size_t>(key_end - p - 1));
+        p = skip_space(key_end + 1, end);
+        if (p == end || *p != ':') return false;
+        p = skip_space(p + 1, end);
+        if (p == end) return false;
+
+        std::string_view value;
+        if (*p == '"') {
+            const char* value_end = string_end(p + 1, end);
+            if (value_end == end) return false;
+            value = std::string_view(p + 1, static_cast<std::size_t>(value_end - p - 1));
+            p = value_end + 1;
+        } else if (*p == '{' || *p == '[') {
+            const char* value_end = skip_nested(p, end);
+            if (!value_end) return false;
+            value = std::string_view(p, static_cast<std::size_t>(value_end - p));
+            p = value_end;
+        } else {
+            const char* value_end = p;
+            while (value_end < end && *value_end != ',' && *value_end != '}'
+                   && *value_end != ' ' && *value_end != '\t' && *value_end != '\r') {
+                ++value_end;
+            }
+            value = std::string_view(p, static_cast<std::size_t>(value_end - p));
+            p = value_end;
+        }
+
+        for (std::size_t i = 0; i < fields.size(); ++i) {
+            if (values[i].data() == nullptr && key == fields[i]) {
+                values[i] = value;
+                if (++found == fields.size()) return true;
+                break;
+            }
+        }
+
+        p = skip_space(p, end);
+        if (p == end) return false;
+        if (*p == ',') {
+            ++p;
+        } else if (*p != '}') {
+            return false;
+        }
+    }
+}
+
+} // namespace rkt::json
+
+namespace rkt {
+
+/**
+ * Field rules applied to JSON-lines output.
+ *
+ * Each rule is "FIELD=VALUE ACTION". VALUE is compared with the field's
+ * value as written (strings without quotes); "*" matches any value. The
+ * actions are:
+ *
+ *  - count: count the matching lines and go on to the next rule. With "*"
+ *    the lines are also counted per value.
+ *  - drop: remove the line from the stream.
+ *  - route=NAME: write the line to the DD NAME, or to the file NAME if it
+ *    contains a "/", instead of the stream.
+ *
+ * Rules are applied in order and the first drop or route rule that
+ * matches decides what happens to the line.
+ */
+class json_rules {
+public:
+    /** Largest number of distinct values counted per "*" count rule. */
+    static constexpr std::size_t max_values = 100;
+
+    /** What a rule does with a matching line. */
+    enum class action { count, drop, route };
+
+    /** One rule and its counters. */
+    struct rule {
+        std::string text;
+        std::size_t field;
+        std::string value;
+        bool any;
+        action act;
+        route_target* target;
+        std::uint64_t hits;
+        std::map<std::string, std::uint64_t, std::less<>> values;
+        std::uint64_t other_values;
+    };
+
+    /** Names of the fields the rules use. */
+    std::vector<std::string> fields;
+    /** The rules in order. */
+    std::vector<rule> rules;
+
+    /**
+     * Reads rules from a file, one per line.
+     *
+     * Trailing blanks are removed. Empty lines and lines starting with "#"
+     * are ignored.
+     *
+     * @param name Path or DD name of the file, e.g. "//DD:JSONRULE"
+     * @param targets Route targets, opened as rules refer to them
+     * @throws std::runtime_error if the file cannot be read or a rule is malformed
+     */
+    static json_rules load(const std::string& name, route_targets& targets) {
+        json_rules result;
+        file f(name, "r");
+        FILE* fp = static_cast<FILE*>(f);
+        char line[4096];
+        while (std::fgets(line, sizeof(line), fp)) {
+            std::string text(line);
+            while (!text.empty() && (text.back() == '\n' || text.back() == ' ')) text.pop_back();
+            if (text.empty() || text[0] == '#') continue;
+            const std::size_t equals = text.find('=');
+            const std::size_t blank = text.find(' ', equals == std::string::npos ? 0 : equals);
+            if (equals == std::string::npos || equals == 0 || blank == std::string::npos) {
+                throw std::runtime_error("JSON rule must be FIELD=VALUE ACTION: " + text);
+            }
+            rule r{text, 0, text.substr(equals + 1, blank - equals - 1), false, action::count, nullptr, 0, {}, 0};
+            r.any = r.value == "*";
+            const std::string act = text.substr(blank + 1);
+            if (act == "drop") {
+                r.act = action::drop;
+            } else if (act.rfind("route=", 0) == 0 && act.size() > 6) {
+                r.act = action::route;
+                r.target = &targets.get(act.substr(6));
+            } else if (act != "count") {
+                throw std::runtime_error("JSON rule action must be count, drop or route=NAME: " + text);
+            }
+            const std::string field = text.substr(0, equals);
+            r.field = result.fields.size();
+            for (std::size_t i = 0; i < result.fields.size(); ++i) {
+                if (result.fields[i] == field) r.field = i;
+            }
+            if (r.field == result.fields.size()) result.fields.push_back(field);
+            result.rules.push_back(std::move(r));
+        }
+        if (result.rules.empty()) throw std::runtime_error(name + " contains no JSON rules");
+        return result;
+    }
+};
+
+/**
+ * Stage that applies json_rules to a stream of JSON lines.
+ *
+ * Each line that holds a JSON object has the fields named by the rules
+ * extracted with json::extract and is then counted, dropped or routed to
+ * another data set by the rules. Lines that are not JSON objects, and
+ * objects no drop or route rule matches, are passed on. The fields are
+ * extracted into a reused vector of views, so no memory is allocated per
+ * line; the lines passed on from one chunk are forwarded with one write.
+ */
+class json_stage : public stage {
+private:
+    json_rules m_rules;
+    line_framer m_framer;
+    std::vector<std::string_view> m_values;
+    std::string m_batch;
+    bool m_continuation{false};
+    const json_rules::rule* m_decision{nullptr};
+    std::uint64_t m_objects{0};
+    std::uint64_t m_other{0};
+
+    const json_rules::rule* apply(std::string_view line) {
+        if (!json::extract(line, m_rules.fields, m_values)) {
+            ++m_other;
+            return nullptr;
+        }
+        ++m_objects;
+        for (auto& r : m_rules.rules) {
+            const std::string_view value = m_values[r.field];
+            if (value.data() == nullptr || (!r.any && value != r.value)) continue;
+            ++r.hits;
+            if (r.act != json_rules::action::count) return &r;
+            if (!r.any) continue;
+            if (auto it = r.values.find(value); it != r.values.end()) {
+                ++it->second;
+            } else if (r.values.size() < json_rules::max_values) {
+                r.values.emplace(value, 1);
+            } else {
+                ++r.other_values;
+            }
+        }
+        return nullptr;
+    }
+
+    void on_line(std::string_view line, bool terminated) {
+        // The pieces of an overlong line share the decision made for the first piece.
+        if (!m_continuation) m_decision = apply(line);
+        m_continuation = !terminated;
+        if (!m_decision) {
+            m_batch.append(line);
+            if (terminated) m_batch.push_back('\n');
+        } else if (m_decision->act == json_rules::action::route) {
+            m_decision->target->write_line(line, terminated);
+        }
+    }
+
+    void forward() {
+        if (m_batch.empty()) return;
+        m_next.write(m_batch.data(), m_batch.size());
+        m_batch.clear();
+    }
+
+public:
+    /**
+     * @param next Sink that receives the lines that are not dropped or routed
+     * @param rules Rules to apply; the stage keeps its own copy and counters
+     */
+    json_stage(sink& next, json_rules rules) : stage(next), m_rules(std::move(rules)) {
+        m_values.reserve(m_rules.fields.size());
+        m_batch.reserve(8 * 1024);
+    }
+
+    void write(const char* data, std::size_t size) override {
+        m_framer.feed(data, size, [this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        forward();
+    }
+
+    void finish() override {
+        m_framer.flush([this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        forward();
+        for (const auto& r : m_rules.rules) {
+            if (r.target) r.target->flush();
+        }
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".json.objects", m_objects);
+        stats.add(prefix + ".json.other_lines", m_other);
+        for (std::size_t i = 0; i < m_rules.rules.size(); ++i) {
+            const auto& r = m_rules.rules[i];
+            stats.add(fmt::format("{}.json.rule.{}", prefix, i + 1), fmt::format("{} {}", r.hits, r.text));
+            for (const auto& [value, count] : r.values) {
+                stats.add(fmt::format("{}.json.{}.{}", prefix, m_rules.fields[r.field], value), count);
+            }
+            if (r.other_values > 0) {
+                stats.add(fmt::format("{}.json.{}.other", prefix, m_rules.fields[r.field]), r.other_values);
+            }
+        }
+    }
+};
+
+} // namespace rkt
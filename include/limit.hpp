@@ -0,0 +1,143 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "spdlog/fmt/fmt.h"
+
+#include "framing.hpp"
+#include "sink.hpp"
+
+namespace rkt {
+
+/**
+ * Stage that keeps only the head and the tail of a stream.
+ *
+ * The head, up to a number of bytes or lines, whichever comes first, is
+ * forwarded as it arrives. Everything after it goes into a ring buffer that
+ * holds the last tail bytes; what the ring overwrites is only counted. When
+ * the stream ends, a "... N bytes omitted ..." line and the tail, starting
+ * at its first whole line, are forwarded. Memory use is the size of the
+ * ring, whatever the size of the stream.
+ */
+class limit_stage : public stage {
+private:
+    std::uint64_t m_head_bytes;
+    std::uint64_t m_head_lines;
+    std::size_t m_tail_bytes;
+    bool m_head_done;
+    std::uint64_t m_head_written{0};
+    std::uint64_t m_head_seen_lines{0};
+    char m_last{'\n'};
+    std::unique_ptr<char[]> m_ring;
+    std::size_t m_ring_pos{0};
+    // Last byte the ring overwrote, the one just before its oldest byte.
+    char m_overwritten{'\n'};
+    std::uint64_t m_after_head{0};
+    std::uint64_t m_omitted{0};
+
+    // Returns how much of a chunk still belongs to the head.
+    std::size_t head_part(const char* data, std::size_t size) {
+        std::size_t n = size;
+        if (m_head_bytes > 0) n = static_cast<std::size_t>(std::min<std::uint64_t>(n, m_head_bytes - m_head_written));
+        if (m_head_lines > 0) {
+            const char* end = data + n;
+            for (const char* p = data; (p = find_newline(p, end)) != end; ++p) {
+                if (++m_head_seen_lines == m_head_lines) {
+                    n = static_cast<std::size_t>(p + 1 - data);
+                    m_head_done = true;
+                    break;
+                }
+            }
+        }
+        m_head_written += n;
+        if (m_head_bytes > 0 && m_head_written == m_head_bytes) m_head_done = true;
+        return n;
+    }
+
+    void keep(const char* data, std::size_t size) {
+        m_after_head += size;
+        if (m_tail_bytes == 0) return;
+        if (!m_ring) m_ring = std::make_unique<char[]>(m_tail_bytes);
+        const std::uint64_t before = m_after_head - size;
+        if (size > m_tail_bytes) {
+            m_overwritten = data[size - m_tail_bytes - 1];
+        } else if (size == m_tail_bytes) {
+            if (before > 0) m_overwritten = m_ring[(m_ring_pos + m_tail_bytes - 1) % m_tail_bytes];
+        } else if (m_after_head > m_tail_bytes) {
+            m_overwritten = m_ring[(m_ring_pos + size - 1) % m_tail_bytes];
+        }
+        if (size >= m_tail_bytes) {
+            std::memcpy(m_ring.get(), data + size - m_tail_bytes, m_tail_bytes);
+            m_ring_pos = 0;
+            return;
+        }
+        const std::size_t first = std::min(size, m_tail_bytes - m_ring_pos);
+        std::memcpy(m_ring.get() + m_ring_pos, data, first);
+        std::memcpy(m_ring.get(), data + first, size - first);
+        m_ring_pos = (m_ring_pos + size) % m_tail_bytes;
+    }
+
+    void forward(const char* data, std::size_t size) {
+        if (size == 0) return;
+        m_next.write(data, size);
+        m_last = data[size - 1];
+    }
+
+public:
+    /**
+     * @param next Sink that receives the head and the tail
+     * @param head_bytes Bytes in the head, or 0 for no byte limit
+     * @param head_lines Lines in the head, or 0 for no line limit
+     * @param tail_bytes Bytes in the tail, or 0 for none
+     */
+    limit_stage(sink& next, std::uint64_t head_bytes, std::uint64_t head_lines, std::size_t tail_bytes)
+        : stage(next), m_head_bytes(head_bytes), m_head_lines(head_lines), m_tail_bytes(tail_bytes),
+          m_head_done(head_bytes == 0 && head_lines == 0) {}
+
+    void write(const char* data, std::size_t size) override {
+        if (!m_head_done) {
+            const std::size_t n = head_part(data, size);
+            forward(data, n);
+            data += n;
+            size -= n;
+        }
+        if (size > 0) keep(data, size);
+    }
+
+    void finish() override {
+        const std::size_t kept = static_cast<std::size_t>(std::min<std::uint64_t>(m_after_head, m_tail_bytes));
+        std::string tail(kept, '\0');
+        if (kept > 0) {
+            // The oldest byte is at the write position once the ring has wrapped.
+            const std::size_t start = m_after_head > m_tail_bytes ? m_ring_pos : 0;
+            std::memcpy(tail.data(), m_ring.get() + start, std::min(kept, m_tail_bytes - start));
+            if (kept > m_tail_bytes - start) std::memcpy(tail.data() + (m_tail_bytes - start), m_ring.get(), start);
+        }
+        std::size_t skip = 0;
+        m_omitted = m_after_head - kept;
+        if (m_omitted > 0) {
+            // Start the tail at a line boundary unless it already starts a line or that would leave nothing.
+            const std::size_t nl = tail.find('\n');
+            if (m_overwritten != '\n' && nl != std::string::npos && nl + 1 < tail.size()) skip = nl + 1;
+            m_omitted += skip;
+            std::string marker = fmt::format("{}... {} bytes omitted ...\n", m_last == '\n' ? "" : "\n", m_omitted);
+            forward(marker.data(), marker.size());
+        }
+        forward(tail.data() + skip, tail.size() - skip);
+        m_ring.reset();
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".limit.head_bytes", m_head_written);
+        stats.add(prefix + ".limit.after_head_bytes", m_after_head);
+        stats.add(prefix + ".limit.bytes_omitted", m_omitted);
+    }
+};
+
+} // namespace rkt
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "spdlog/fmt/fmt.h"
+
+#include "file.hpp"
+#include "filter.hpp"
+#include "framing.hpp"
+#include "sink.hpp"
+
+namespace rkt::line_index {
+
+/** First line of every line index file. */
+inline constexpr const char* index_header = "# rktbatch line index v1";
+
+/** Byte offset of a line in the indexed file. */
+struct entry {
+    /** Line number, counting from 1. */
+    std::uint64_t line{1};
+    /** Offset of the line's first byte. */
+    std::uint64_t offset{0};
+    /** For a marked line, the number of the pattern it matched, counting from 1. */
+    std::size_t pattern{0};
+};
+
+/**
+ * Contents of a line index file.
+ *
+ * The file is text. After the header, "P N TEXT" names pattern N,
+ * "S LINE OFFSET" is a sampled line, "M LINE OFFSET N" is a line that
+ * matched pattern N and "E LINES BYTES" ends a complete index.
+ */
+struct contents {
+    std::vector<std::string> patterns;
+    /** Sampled lines in line order; the first is always line 1. */
+    std::vector<entry> samples;
+    /** Lines that matched a pattern, in line order. */
+    std::vector<entry> marks;
+    /** Number of lines, counting a final line without a new line. Only set if complete. */
+    std::uint64_t lines{0};
+    /** Size of the indexed file. Only set if complete. */
+    std::uint64_t bytes{0};
+    /** False while the file is still being written, or if the step ended abnormally. */
+    bool complete{false};
+
+    /**
+     * Returns the last sample at or before a line.
+     *
+     * @param line Line number, counting from 1
+     */
+    const entry& sample_before(std::uint64_t line) const {
+        std::size_t lo = 0, hi = samples.size();
+        while (hi - lo > 1) {
+            std::size_t mid = (lo + hi) / 2;
+            if (samples[mid].line <= line) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        return samples[lo];
+    }
+};
+
+/**
+ * Reads a line index file.
+ *
+ * @param name Path of the index file
+ * @throws std::runtime_error if the file cannot be read or is not a line index
+ */
+inline contents read_index(const std::string& name) {
+    file index(name, "r");
+    FILE* fp = static_cast<FILE*>(index);
+    char line[4096];
+    if (!std::fgets(line, sizeof(line), fp) || std::string(line).rfind(index_header, 0) != 0) {
+        throw std::runtime_error(name + " is not a line index");
+    }
+    contents result;
+    while (std::fgets(line, sizeof(line), fp)) {
+        unsigned long long a, b;
+        unsigned long n;
+        int used = 0;
+        bool ok = false;
+        switch (line[0]) {
+            case 'P':
+                if (std::sscanf(line, "P %lu %n", &n, &used) == 1 && used > 0) {
+                    std::string text(line + used);
+                    while (!text.empty() && text.back() == '\n') text.pop_back();
+                    result.patterns.push_back(text);
+                    ok = true;
+                }
+                break;
+            case 'S':
+                if (std::sscanf(line, "S %llu %llu", &a, &b) == 2) {
+                    result.samples.push_back({a, b, 0});
+                    ok = true;
+                }
+                break;
+            case 'M':
+                if (std::sscanf(line, "M %llu %llu %lu", &a, &b, &n) == 3) {
+                    result.marks.push_back({a, b, n});
+                    ok = true;
+                }
+                break;
+            case 'E':
+                if (std::sscanf(line, "E %llu %llu", &a, &b) == 2) {
+                    result.lines = a;
+                    result.bytes = b;
+                    result.complete = true;
+                    ok = true;
+                }
+                break;
+            default:
+                break;
+        }
+        if (!ok) throw std::runtime_error("Malformed line index entry in " + name + ": " + line);
+    }
+    if (result.samples.empty()) result.samples.push_back({1, 0, 0});
+    return result;
+}
+
+} // namespace rkt::line_index
+
+namespace rkt {
+
+/**
+ * Stage that writes a line index of the stream it forwards.
+ *
+ * The byte offset of every Nth line is written to the index file, as is the
+ * offset of every line that matches one of a set of patterns, e.g. error
+ * messages. A reader can then go straight to a line number, the end of the
+ * file or the marked lines instead of scanning the whole file. Entries are
+ * batched and appended as the stream is written, so the index can be used
+ * while the program runs; it ends with the line and byte counts when the
+ * stream ends.
+ *
+ * Offsets are those of the stream as it leaves this stage, so it must be
+ * the last stage before a file written from its start.
+ */
+class line_index_sink : public stage {
+private:
+    file& m_index;
+    std::uint64_t m_every;
+    std::shared_ptr<const pattern_set> m_patterns;
+    line_framer m_framer;
+    std::string m_entries;
+    bool m_continuation{false};
+    std::uint64_t m_line{0};
+    std::uint64_t m_offset{0};
+    std::uint64_t m_samples{0};
+    std::uint64_t m_marks{0};
+
+    void on_line(std::string_view line, bool terminated) {
+        // The pieces of an overlong line belong to the line of the first piece.
+        if (!m_continuation) {
+            ++m_line;
+            if ((m_line - 1) % m_every == 0) {
+                fmt::format_to(std::back_inserter(m_entries), "S {} {}\n", m_line, m_offset);
+                ++m_samples;
+            }
+            if (m_patterns) {
+                bool prefiltered;
+                const std::size_t index = m_patterns->match(line, prefiltered);
+                if (index != pattern_set::npos) {
+                    fmt::format_to(std::back_inserter(m_entries), "M {} {} {}\n", m_line, m_offset, index + 1);
+                    ++m_marks;
+                }
+            }
+        }
+        m_continuation = !terminated;
+        m_offset += line.size() + (terminated ? 1 : 0);
+    }
+
+    void write_entries() {
+        if (m_entries.empty()) return;
+        m_index.write(m_entries.data(), m_entries.size());
+        m_entries.clear();
+    }
+
+public:
+    /**
+     * @param next Sink that receives the unchanged data
+     * @param index Open file that receives the index
+     * @param every Sample every this many lines
+     * @param patterns Patterns whose matching lines are marked, or nullptr
+     */
+    line_index_sink(sink& next, file& index, std::uint64_t every, std::shared_ptr<const pattern_set> patterns)
+        : stage(next), m_index(index), m_every(every ? every : 1), m_patterns(std::move(patterns)) {
+        m_entries.reserve(64 * 1024);
+        m_entries.append(line_index::index_header).push_back('\n');
+        if (m_patterns) {
+            for (std::size_t i = 0; i < m_patterns->size(); ++i) {
+                fmt::format_to(std::back_inserter(m_entries), "P {} {}\n", i + 1, m_patterns->text(i));
+            }
+        }
+        write_entries();
+    }
+
+    void write(const char* data, std::size_t size) override {
+        m_framer.feed(data, size, [this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        m_next.write(data, size);
+        if (m_entries.size() >= 60 * 1024) write_entries();
+    }
+
+    void finish() override {
+        m_framer.flush([this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        fmt::format_to(std::back_inserter(m_entries), "E {} {}\n", m_line, m_offset);
+        write_entries();
+        std::fflush(static_cast<FILE*>(m_index));
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".line_index.lines", m_line);
+        stats.add(prefix + ".line_index.samples", m_samples);
+        stats.add(prefix + ".line_index.marks", m_marks);
+    }
+};
+
+} // namespace rkt
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "framing.hpp"
+#include "sink.hpp"
+#include "timestamp.hpp"
+
+namespace rkt {
+
+/**
+ * Stage that merges STDOUT and STDERR into one stream of whole lines.
+ *
+ * The stage itself receives STDOUT; STDERR is written to stderr_port(),
+ * which is used as the terminal sink of the STDERR pipeline. Every chunk
+ * is tagged with a read sequence number and read time as it arrives.
+ * Complete lines are appended to the merged output in sequence order, so
+ * lines appear in the order the relay read them and a line from one stream
+ * is never cut by a line from the other. A line that spans reads is held
+ * per stream until it is complete and keeps the time of its first read.
+ *
+ * Each line can be prefixed with its read time and an "O " or "E " marker
+ * naming the stream. The lines completed by one chunk are forwarded with a
+ * single write. Every merged line ends with a new line; lines longer than
+ * the framing limit are split.
+ *
+ * The merged stream is finished when both inputs have finished, whichever
+ * order the pipelines are finished in.
+ */
+class merge_stage : public stage {
+private:
+    // One input stream of the merge.
+    struct input {
+        const char* marker;
+        line_framer framer;
+        std::int64_t line_time{0};
+        std::uint64_t reads{0};
+        std::uint64_t lines{0};
+        bool finished{false};
+
+        explicit input(const char* m) : marker(m) {}
+    };
+
+    // Sink written by the STDERR pipeline.
+    class port : public sink {
+    private:
+        merge_stage& m_merge;
+
+    public:
+        explicit port(merge_stage& merge) : m_merge(merge) {}
+        void write(const char* data, std::size_t size) override { m_merge.relay(m_merge.m_err, data, size); }
+        void finish() override { m_merge.finish_input(m_merge.m_err); }
+    };
+
+    input m_out{"O "};
+    input m_err{"E "};
+    port m_port{*this};
+    bool m_markers;
+    bool m_timestamps;
+    timestamp_text m_text;
+    std::string m_batch;
+    const input* m_last{nullptr};
+    std::uint64_t m_sequence{0};
+    std::uint64_t m_switches{0};
+
+    void append(const input& in, std::string_view line, std::int64_t time) {
+        if (m_timestamps) m_batch.append(m_text.at(time));
+        if (m_markers) m_batch.append(in.marker);
+        m_batch.append(line);
+        m_batch.push_back('\n');
+    }
+
+    void relay(input& in, const char* data, std::size_t size) {
+        if (size == 0) return;
+        const std::int64_t now = coarse_clock_ns();
+        ++m_sequence;
+        ++in.reads;
+        if (m_last != &in) {
+            if (m_last) ++m_switches;
+            m_last = &in;
+        }
+        // A line carried over from an earlier read keeps that read's time.
+        bool carried = in.framer.pending() > 0;
+        in.framer.feed(data, size, [&](std::string_view line, bool) {
+            append(in, line, carried ? in.line_time : now);
+            carried = false;
+            ++in.lines;
+        });
+        if (!carried) in.line_time = now;
+        forward();
+    }
+
+    void finish_input(input& in) {
+        if (in.finished) return;
+        in.finished = true;
+        in.framer.flush([&](std::string_view line, bool) {
+            append(in, line, in.line_time);
+            ++in.lines;
+        });
+        forward();
+        if (m_out.finished && m_err.finished) stage::finish();
+    }
+
+    void forward() {
+        if (m_batch.empty()) return;
+        m_next.write(m_batch.data(), m_batch.size());
+        m_batch.clear();
+    }
+
+public:
+    /**
+     * @param next Sink that receives the merged stream
+     * @param markers Prefix each line with "O " or "E "
+     * @param timestamps Prefix each line with its read time
+     */
+    merge_stage(sink& next, bool markers, bool timestamps)
+        : stage(next), m_markers(markers), m_timestamps(timestamps) {
+        m_batch.reserve(8 * 1024);
+    }
+
+    /** Returns the sink that receives STDERR. */
+    sink& stderr_port() noexcept { return m_port; }
+
+    void write(const char* data, std::size_t size) override { relay(m_out, data, size); }
+
+    void finish() override { finish_input(m_out); }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".merge.reads", m_sequence);
+        stats.add(prefix + ".merge.stdout_reads", m_out.reads);
+        stats.add(prefix + ".merge.stdout_lines", m_out.lines);
+        stats.add(prefix + ".merge.stderr_reads", m_err.reads);
+        stats.add(prefix + ".merge.stderr_lines", m_err.lines);
+        stats.add(prefix + ".merge.switches", m_switches);
+    }
+};
+
+} // namespace rkt
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "spdlog/fmt/fmt.h"
+
+#include "framing.hpp"
+#include "sink.hpp"
+#include "timestamp.hpp"
+
+namespace rkt {
+
+/**
+ * Token bucket that is only refilled when it runs dry.
+ *
+ * Tokens are taken without looking at the clock. Only when the bucket
+ * cannot cover a request is the clock read, and the bucket refilled for the
+ * time that has passed since the last refill, up to one second's worth, so
+ * output under the rate costs a subtraction and output over it costs one
+ * clock read per refill.
+ *
+ * This class is not thread safe.
+ */
+class token_bucket {
+private:
+    double m_rate;
+    double m_tokens;
+    std::int64_t m_refilled_ns;
+
+public:
+    /**
+     * @param rate Tokens per second; the bucket holds one second's worth
+     */
+    explicit token_bucket(double rate) : m_rate(rate), m_tokens(rate), m_refilled_ns(coarse_clock_ns()) {}
+
+    /** Returns true if the bucket is in use. */
+    bool enabled() const noexcept { return m_rate > 0; }
+
+    /** Returns the tokens added per second. */
+    double rate() const noexcept { return m_rate; }
+
+    /** Returns the tokens available, which may be negative after take(). */
+    double tokens() const noexcept { return m_tokens; }
+
+    /** Takes tokens, going into debt if there are not enough. */
+    void take(double n) noexcept { m_tokens -= n; }
+
+    /** Refills the bucket for the time since the last refill. */
+    void refill(std::int64_t now) noexcept {
+        if (now <= m_refilled_ns) return;
+        m_tokens = std::min(m_rate, m_tokens + m_rate * static_cast<double>(now - m_refilled_ns) / 1e9);
+        m_refilled_ns = now;
+    }
+
+    /** Returns the nanoseconds until the bucket is out of debt. */
+    std::int64_t debt_ns() const noexcept {
+        return m_tokens >= 0 ? 0 : static_cast<std::int64_t>(-m_tokens / m_rate * 1e9) + 1;
+    }
+};
+
+/**
+ * Stage that limits a stream to a number of bytes and lines per second.
+ *
+ * Each limit is a token_bucket that allows a burst of one second's output.
+ * Over the limit, the stage either delays, sleeping until the buckets are
+ * out of debt, which stops the relay reading and so holds the program up
+ * once its pipe is full; or drops whole lines until the buckets have
+ * refilled, writing a "[N lines dropped by rate limit]" line where they
+ * were left out. Under the limit no clock is read.
+ */
+class rate_limit_stage : public stage {
+private:
+    token_bucket m_bytes;
+    token_bucket m_lines;
+    bool m_drop;
+    line_framer m_framer;
+    std::string m_batch;
+    bool m_continuation{false};
+    bool m_dropping{false};
+    bool m_refilled{false};
+    std::uint64_t m_pending_drops{0};
+    std::uint64_t m_lines_dropped{0};
+    std::uint64_t m_bytes_dropped{0};
+    std::uint64_t m_delays{0};
+    std::uint64_t m_throttled_ns{0};
+
+    bool over() const noexcept {
+        return (m_bytes.enabled() && m_bytes.tokens() < 0) || (m_lines.enabled() && m_lines.tokens() < 0);
+    }
+
+    // Returns true if the buckets cannot cover a line of this size. A line
+    // longer than a second's worth of bytes passes when the bucket is full.
+    bool short_of(double size) const noexcept {
+        return (m_bytes.enabled() && m_bytes.tokens() < std::min(size, m_bytes.rate()))
+               || (m_lines.enabled() && m_lines.tokens() < 1);
+    }
+
+    void delay() {
+        std::int64_t now = coarse_clock_ns();
+        m_bytes.refill(now);
+        m_lines.refill(now);
+        const std::int64_t wait = std::max(m_bytes.enabled() ? m_bytes.debt_ns() : 0,
+                                           m_lines.enabled() ? m_lines.debt_ns() : 0);
+        if (wait <= 0) return;
+        ++m_delays;
+        auto start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+        m_throttled_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        now = coarse_clock_ns();
+        m_bytes.refill(now);
+        m_lines.refill(now);
+    }
+
+    void add_marker() {
+        if (m_pending_drops == 0) return;
+        fmt::format_to(std::back_inserter(m_batch), "[{} lines dropped by rate limit]\n", m_pending_drops);
+        m_pending_drops = 0;
+    }
+
+    void on_line(std::string_view line, bool terminated) {
+        // The pieces of an overlong line share the decision made for the first piece.
+        if (!m_continuation) {
+            const double size = static_cast<double>(line.size()) + (terminated ? 1 : 0);
+            m_dropping = false;
+            if (short_of(size)) {
+                // Refill at most once per chunk, so a flood of lines costs one clock read per chunk.
+                if (!m_refilled) {
+                    const std::int64_t now = coarse_clock_ns();
+                    m_bytes.refill(now);
+                    m_lines.refill(now);
+                    m_refilled = true;
+                }
+                m_dropping = short_of(size);
+            }
+            if (m_dropping) {
+                ++m_pending_drops;
+                ++m_lines_dropped;
+            } else {
+                add_marker();
+                m_lines.take(1);
+            }
+        }
+        m_continuation = !terminated;
+        if (m_dropping) {
+            m_bytes_dropped += line.size() + (terminated ? 1 : 0);
+            return;
+        }
+        m_bytes.take(static_cast<double>(line.size()) + (terminated ? 1 : 0));
+        m_batch.append(line);
+        if (terminated) m_batch.push_back('\n');
+    }
+
+    void forward() {
+        if (m_batch.empty()) return;
+        m_next.write(m_batch.data(), m_batch.size());
+        m_batch.clear();
+    }
+
+public:
+    /**
+     * @param next Sink that receives the limited stream
+     * @param bytes_per_second Byte limit, or 0 for none
+     * @param lines_per_second Line limit, or 0 for none
+     * @param drop Drop lines over the limit instead of delaying them
+     */
+    rate_limit_stage(sink& next, double bytes_per_second, double lines_per_second, bool drop)
+        : stage(next), m_bytes(bytes_per_second), m_lines(lines_per_second), m_drop(drop) {
+        if (m_drop) m_batch.reserve(8 * 1024);
+    }
+
+    void write(const char* data, std::size_t size) override {
+        if (m_drop) {
+            m_refilled = false;
+            m_framer.feed(data, size, [this](std::string_view line, bool terminated) { on_line(line, terminated); });
+            forward();
+            return;
+        }
+        if (m_bytes.enabled()) m_bytes.take(static_cast<double>(size));
+        if (m_lines.enabled()) {
+            std::uint64_t lines = 0;
+            const char* end = data + size;
+            for (const char* p = data; (p = find_newline(p, end)) != end; ++p) ++lines;
+            m_lines.take(static_cast<double>(lines));
+        }
+        if (over()) delay();
+        m_next.write(data, size);
+    }
+
+    void finish() override {
+        if (m_drop) {
+            m_framer.flush([this](std::string_view line, bool terminated) { on_line(line, terminated); });
+            add_marker();
+            forward();
+        }
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        if (m_drop) {
+            stats.add(prefix + ".rate.lines_dropped", m_lines_dropped);
+            stats.add(prefix + ".rate.bytes_dropped", m_bytes_dropped);
+        } else {
+            stats.add(prefix + ".rate.delays", m_delays);
+            stats.add(prefix + ".rate.throttled_ns", m_throttled_ns);
+        }
+    }
+};
+
+} // namespace rkt
@@ -0,0 +1,388 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "framing.hpp"
+#include "sink.hpp"
+#include "source.hpp"
+
+namespace rkt::records {
+
+/**
+ * Returns the length of a record without its trailing pad characters.
+ *
+ * The record is scanned backwards eight bytes at a time while whole words
+ * consist of pad characters, then byte by byte.
+ *
+ * @param record Start of the record
+ * @param length Length of the record
+ * @param pad Pad character
+ * @return length of the record without trailing pad
+ */
+inline std::size_t trimmed_length(const char* record, std::size_t length, char pad) noexcept {
+    std::uint64_t pads;
+    std::memset(&pads, pad, sizeof(pads));
+    while (length >= sizeof(pads)) {
+        std::uint64_t word;
+        std::memcpy(&word, record + length - sizeof(word), sizeof(word));
+        if (word != pads) break;
+        length -= sizeof(word);
+    }
+    while (length > 0 && record[length - 1] == pad) --length;
+    return length;
+}
+
+/** Largest block size supported for record output. */
+inline constexpr std::size_t max_blksize = 32760;
+
+/** Length of a record or block descriptor word. */
+inline constexpr std::size_t descriptor_length = 4;
+
+/**
+ * Stores a record or block descriptor word.
+ *
+ * The first two bytes hold the big-endian length, including the descriptor
+ * itself, and the last two bytes are zero.
+ *
+ * @param out Destination for the four descriptor bytes
+ * @param length Length including the descriptor
+ */
+inline void put_descriptor(char* out, std::size_t length) noexcept {
+    out[0] = static_cast<char>((length >> 8) & 0xFF);
+    out[1] = static_cast<char>(length & 0xFF);
+    out[2] = 0;
+    out[3] = 0;
+}
+
+} // namespace rkt::records
+
+namespace rkt {
+
+/**
+ * Source stage that converts fixed-length records to lines.
+ *
+ * Input is read in blocks holding a whole number of records. Each record
+ * has its trailing pad removed and a new line appended, so a child reading
+ * card images sees ordinary text. A short final record is treated as a
+ * complete record.
+ */
+class fixed_record_source : public source_stage {
+private:
+    std::size_t m_lrecl;
+    char m_pad;
+    std::vector<char> m_in;
+    std::size_t m_in_size{0};
+    std::vector<char> m_out;
+    std::size_t m_out_pos{0};
+    bool m_eof{false};
+    std::uint64_t m_records{0};
+    std::uint64_t m_pad_stripped{0};
+
+    void convert(const char* record, std::size_t length) {
+        std::size_t trimmed = records::trimmed_length(record, length, m_pad);
+        m_out.insert(m_out.end(), record, record + trimmed);
+        m_out.push_back('\n');
+        m_pad_stripped += length - trimmed;
+        ++m_records;
+    }
+
+    // Converts the next block of records into m_out. Returns false at end of data.
+    bool fill() {
+        m_out.clear();
+        m_out_pos = 0;
+        while (m_out.empty() && !m_eof) {
+            std::size_t n = m_upstream.read(m_in.data() + m_in_size, m_in.size() - m_in_size);
+            if (n == 0) {
+                m_eof = true;
+                if (m_in_size > 0) convert(m_in.data(), m_in_size);
+                m_in_size = 0;
+                break;
+            }
+            m_in_size += n;
+            std::size_t whole = m_in_size - m_in_size % m_lrecl;
+            for (std::size_t pos = 0; pos < whole; pos += m_lrecl) {
+                convert(m_in.data() + pos, m_lrecl);
+            }
+            // Carry a partial record over to the next read.
+            std::memmove(m_in.data(), m_in.data() + whole, m_in_size - whole);
+            m_in_size -= whole;
+        }
+        return !m_out.empty();
+    }
+
+public:
+    /**
+     * @param upstream Source of fixed-length records
+     * @param lrecl Record length
+     * @param pad Pad character stripped from the end of each record
+     * @param block_records Number of records read at a time
+     *
+     * @throws std::invalid_argument if lrecl is zero
+     */
+    fixed_record_source(source& upstream, std::size_t lrecl, char pad = ' ', std::size_t block_records = 512)
+        : source_stage(upstream), m_lrecl(lrecl), m_pad(pad) {
+        if (lrecl == 0) throw std::invalid_argument("Record length must be positive");
+        m_in.resize(lrecl * block_records);
+        m_out.reserve((lrecl + 1) * block_records);
+    }
+
+    std::size_t read(char* buffer, std::size_t size) override {
+        if (m_out_pos == m_out.size() && !fill()) return 0;
+        std::size_t n = std::min(size, m_out.size() - m_out_pos);
+        std::memcpy(buffer, m_out.data() + m_out_pos, n);
+        m_out_pos += n;
+        return n;
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".records", m_records);
+        stats.add(prefix + ".pad_bytes_stripped", m_pad_stripped);
+    }
+};
+
+/**
+ * Stage that converts a stream of lines to blocked fixed-length records.
+ *
+ * Each line is padded to the record length, or folded over as many records
+ * as it needs when it is longer. Records are packed into a block buffer and
+ * every full block is written to the next sink in a single call, so the
+ * number of writes depends on the block size rather than the number of lines.
+ * The last block may be short.
+ */
+class fixed_record_sink : public stage {
+private:
+    std::size_t m_lrecl;
+    char m_pad;
+    std::vector<char> m_block;
+    std::size_t m_fill{0};
+    // Number of bytes already placed in the current record.
+    std::size_t m_column{0};
+    std::uint64_t m_records{0};
+    std::uint64_t m_folded{0};
+    std::uint64_t m_blocks{0};
+
+    void commit_record() {
+        m_fill += m_lrecl;
+        m_column = 0;
+        ++m_records;
+        if (m_fill == m_block.size()) flush_block();
+    }
+
+    void flush_block() {
+        if (m_fill == 0) return;
+        m_next.write(m_block.data(), m_fill);
+        m_fill = 0;
+        ++m_blocks;
+    }
+
+    void place(const char* data, std::size_t size) {
+        while (size > 0) {
+            if (m_column == m_lrecl) {
+                commit_record();
+                ++m_folded;
+            }
+            std::size_t n = std::min(size, m_lrecl - m_column);
+            std::memcpy(m_block.data() + m_fill + m_column, data, n);
+            m_column += n;
+            data += n;
+            size -= n;
+        }
+    }
+
+    void end_line() {
+        std::memset(m_block.data() + m_fill + m_column, m_pad, m_lrecl - m_column);
+        commit_record();
+    }
+
+public:
+    /**
+     * @param next Sink that receives whole blocks
+     * @param lrecl Record length
+     * @param blksize Block size, rounded down to a multiple of lrecl. If zero
+     *                the largest multiple of lrecl up to 32760 is used.
+     * @param pad Pad character for short lines
+     *
+     * @throws std::invalid_argument if lrecl is zero or does not fit in a block
+     */
+    fixed_record_sink(sink& next, std::size_t lrecl, std::size_t blksize = 0, char pad = ' ')
+        : stage(next), m_lrecl(lrecl), m_pad(pad) {
+        if (lrecl == 0 || lrecl > records::max_blksize) throw std::invalid_argument("Invalid record length");
+        if (blksize == 0) blksize = records::max_blksize;
+        if (blksize < lrecl) throw std::invalid_argument("Block size is smaller than the record length");
+        m_block.resize(blksize - blksize % lrecl);
+    }
+
+    void write(const char* data, std::size_t size) override {
+        const char* end = data + size;
+        while (data < end) {
+            const char* nl = find_newline(data, end);
+            if (nl == end) {
+                place(data, end - data);
+                break;
+            }
+            place(data, nl - data);
+            end_line();
+            data = nl + 1;
+        }
+    }
+
+    void finish() override {
+        if (m_column > 0) end_line();
+        flush_block();
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".records", m_records);
+        stats.add(prefix + ".records_folded", m_folded);
+        stats.add(prefix + ".blocks", m_blocks);
+    }
+};
+
+/**
+ * Stage that converts a stream of records to blocked variable-length records.
+ *
+ * Records are either delimited by new lines, or each is preceded by a
+ * four byte big-endian length written by the child, which makes the output
+ * binary safe. Every record is written with a record descriptor word (RDW)
+ * and packed into blocks that start with a block descriptor word (BDW), the
+ * RECFM=VB layout. Records longer than LRECL minus the RDW are split. Every
+ * full block is written to the next sink in a single call.
+ */
+class variable_record_sink : public stage {
+public:
+    /** How records are delimited in the child's stream. */
+    enum class delimiter { newline, length };
+
+private:
+    delimiter m_delimiter;
+    std::size_t m_max_data;
+    std::vector<char> m_block;
+    std::size_t m_fill{records::descriptor_length};
+    std::vector<char> m_record;
+    // State of the length prefix parser.
+    char m_header[records::descriptor_length] = {};
+    std::size_t m_header_size{0};
+    std::size_t m_remaining{0};
+    std::uint64_t m_records{0};
+    std::uint64_t m_split{0};
+    std::uint64_t m_blocks{0};
+
+    void flush_block() {
+        if (m_fill == records::descriptor_length) return;
+        records::put_descriptor(m_block.data(), m_fill);
+        m_next.write(m_block.data(), m_fill);
+        m_fill = records::descriptor_length;
+        ++m_blocks;
+    }
+
+    void end_record() {
+        std::size_t length = records::descriptor_length + m_record.size();
+        if (m_fill + length > m_block.size()) flush_block();
+        records::put_descriptor(m_block.data() + m_fill, length);
+        std::memcpy(m_block.data() + m_fill + records::descriptor_length, m_record.data(), m_record.size());
+        m_fill += length;
+        m_record.clear();
+        ++m_records;
+    }
+
+    void append(const char* data, std::size_t size) {
+        while (size > 0) {
+            if (m_record.size() == m_max_data) {
+                end_record();
+                ++m_split;
+            }
+            std::size_t n = std::min(size, m_max_data - m_record.size());
+            m_record.insert(m_record.end(), data, data + n);
+            data += n;
+            size -= n;
+        }
+    }
+
+    void write_lines(const char* data, const char* end) {
+        while (data < end) {
+            const char* nl = find_newline(data, end);
+            if (nl == end) {
+                append(data, end - data);
+                break;
+            }
+            append(data, nl - data);
+            end_record();
+            data = nl + 1;
+        }
+    }
+
+    void write_prefixed(const char* data, const char* end) {
+        while (data < end) {
+            if (m_header_size < records::descriptor_length) {
+                m_header[m_header_size++] = *data++;
+                if (m_header_size < records::descriptor_length) continue;
+                const auto* h = reinterpret_cast<const unsigned char*>(m_header);
+                m_remaining = (std::size_t{h[0]} << 24) | (std::size_t{h[1]} << 16)
+                    | (std::size_t{h[2]} << 8) | h[3];
+                if (m_remaining > 0) continue;
+            } else {
+                std::size_t n = std::min(m_remaining, static_cast<std::size_t>(end - data));
+                append(data, n);
+                data += n;
+                m_remaining -= n;
+                if (m_remaining > 0) continue;
+            }
+            end_record();
+            m_header_size = 0;
+        }
+    }
+
+public:
+    /**
+     * @param next Sink that receives whole blocks
+     * @param lrecl Maximum record length, including the RDW
+     * @param blksize Block size, including the BDW. If zero 32760 is used.
+     * @param delim How records are delimited in the input
+     *
+     * @throws std::invalid_argument if a maximum length record does not fit in a block
+     */
+    variable_record_sink(sink& next, std::size_t lrecl, std::size_t blksize = 0, delimiter delim = delimiter::newline)
+        : stage(next), m_delimiter(delim) {
+        if (blksize == 0) blksize = records::max_blksize;
+        if (lrecl <= records::descriptor_length || blksize > records::max_blksize
+            || lrecl + records::descriptor_length > blksize) {
+            throw std::invalid_argument("Invalid record length or block size");
+        }
+        m_max_data = lrecl - records::descriptor_length;
+        m_block.resize(blksize);
+        m_record.reserve(m_max_data);
+    }
+
+    void write(const char* data, std::size_t size) override {
+        if (m_delimiter == delimiter::newline) write_lines(data, data + size);
+        else write_prefixed(data, data + size);
+    }
+
+    void finish() override {
+        if (m_header_size > 0 && m_header_size < records::descriptor_length) {
+            // A partial length prefix has no record behind it.
+            spdlog::warn("Stream ended {} bytes into a record length prefix; the bytes were dropped", m_header_size);
+            m_header_size = 0;
+        } else if (!m_record.empty() || m_header_size > 0) {
+            if (m_remaining > 0) spdlog::warn("Last record is {} bytes shorter than its length prefix", m_remaining);
+            end_record();
+        }
+        flush_block();
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".records", m_records);
+        stats.add(prefix + ".records_split", m_split);
+        stats.add(prefix + ".blocks", m_blocks);
+    }
+};
+
+} // namespace rkt
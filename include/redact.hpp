@@ -0,0 +1,283 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "aho_corasick.hpp"
+#include "file.hpp"
+#include "sink.hpp"
+
+namespace rkt {
+
+/**
+ * Secrets and secret-introducing prefixes to redact from output.
+ *
+ * A secret is a literal that is replaced by the mask wherever it occurs.
+ * A prefix, such as "Authorization: Basic", is kept but the token that
+ * follows it (after any blanks, up to the next blank, quote or separator)
+ * is replaced by the mask. Both kinds are compiled into one Aho-Corasick
+ * automaton. Rules are immutable once built and can be shared by several
+ * redaction stages.
+ */
+class redaction_rules {
+public:
+    /** Text written in place of a secret. */
+    static constexpr std::string_view mask = "********";
+
+    /** Shortest secret accepted; shorter values would mask ordinary text. */
+    static constexpr std::size_t min_secret = 4;
+
+private:
+    aho_corasick m_automaton;
+    std::vector<bool> m_prefix;
+
+    void add(std::string_view text, bool prefix) {
+        m_automaton.add(text, static_cast<std::uint32_t>(m_prefix.size()));
+        m_prefix.push_back(prefix);
+    }
+
+public:
+    /**
+     * Adds a literal secret.
+     *
+     * @throws std::invalid_argument if the secret is shorter than min_secret
+     */
+    void add_secret(std::string_view secret) {
+        if (secret.size() < min_secret) {
+            throw std::invalid_argument(fmt::format("Secrets must be at least {} characters", min_secret));
+        }
+        add(secret, false);
+    }
+
+    /**
+     * Adds a prefix whose following token is a secret.
+     *
+     * @throws std::invalid_argument if the prefix is empty
+     */
+    void add_prefix(std::string_view prefix) { add(prefix, true); }
+
+    /**
+     * Adds the HTTP authorization headers printed by curl -v and similar tools.
+     */
+    void add_defaults() {
+        for (const char* header : {"Authorization:", "authorization:", "Proxy-Authorization:", "proxy-authorization:"}) {
+            for (const char* scheme : {" Basic", " Bearer"}) {
+                add_prefix(std::string(header) + scheme);
+            }
+        }
+    }
+
+    /**
+     * Reads rules from a file, one per line.
+     *
+     * A line starting with "prefix:" adds the rest of the line as a prefix;
+     * any other line is a secret. Trailing blanks are removed, so rules may
+     * be kept in a fixed-length data set. Empty lines and lines starting
+     * with "#" are ignored.
+     *
+     * @param name Path or DD name of the file, e.g. "//DD:REDACT"
+     * @throws std::runtime_error if the file cannot be read
+     */
+    void load(const std::string& name) {
+        file f(name, "r");
+        FILE* fp = static_cast<FILE*>(f);
+        char line[4096];
+        while (std::fgets(line, sizeof(line), fp)) {
+            std::string text(line);
+            while (!text.empty() && (text.back() == '\n' || text.back() == ' ')) text.pop_back();
+            if (text.empty() || text[0] == '#') continue;
+            if (text.rfind("prefix:", 0) == 0) {
+                add_prefix(std::string_view(text).substr(7));
+            } else {
+                add_secret(text);
+            }
+        }
+    }
+
+    /** Prepares the rules for matching. Must be called after the last rule is added. */
+    void build() { m_automaton.build(); }
+
+    /** Returns the number of rules. */
+    std::size_t size() const noexcept { return m_prefix.size(); }
+
+    /** Returns the automaton matching every rule. */
+    const aho_corasick& automaton() const noexcept { return m_automaton; }
+
+    /** Returns true if a rule is a prefix. */
+    bool is_prefix(std::uint32_t id) const { return m_prefix[id]; }
+};
+
+/**
+ * Stage that replaces secrets in the stream with a fixed mask.
+ *
+ * The automaton runs over the stream a byte at a time and its state is
+ * kept across writes, so a secret split between two reads is still found.
+ * Bytes that may be the start of a secret - as many as the depth of the
+ * current state - are held back until the secret is either completed or
+ * ruled out; everything else is forwarded with one write per chunk.
+ * A matched secret is not masked at once: the span is kept pending while
+ * the automaton can still complete a longer or overlapping secret, and
+ * overlapping spans are merged, so when one secret is a prefix of or lies
+ * inside another no part of either is forwarded.
+ */
+class redact_stage : public stage {
+private:
+    std::shared_ptr<const redaction_rules> m_rules;
+    const aho_corasick& m_automaton;
+    aho_corasick::state_type m_state{aho_corasick::root};
+    // Offsets are counted from the start of the stream. m_held holds the
+    // bytes before the current chunk that have not been forwarded.
+    std::uint64_t m_total{0};
+    std::uint64_t m_forwarded{0};
+    std::string m_held;
+    std::string m_batch;
+    bool m_masking{false};
+    std::uint64_t m_mask_start{0};
+    std::uint64_t m_mask_end{0};
+    bool m_starts[256] = {};
+    enum class token { none, leading_blanks, inside } m_token{token::none};
+    std::uint64_t m_secrets{0};
+    std::uint64_t m_tokens{0};
+
+    static bool ends_token(char c) noexcept {
+        switch (c) {
+            case ' ': case '\t': case '\n': case '\r': case '"': case '\'': case ',': case ';': case '&':
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Forwards the bytes up to offset to, from the held bytes and then the chunk that starts at offset base.
+    void pass(std::uint64_t to, const char* data, std::uint64_t base) {
+        if (to <= m_forwarded) return;
+        if (m_forwarded < base) {
+            const std::uint64_t held_start = base - m_held.size();
+            const std::uint64_t stop = std::min(to, base);
+            m_batch.append(m_held, static_cast<std::size_t>(m_forwarded - held_start),
+                           static_cast<std::size_t>(stop - m_forwarded));
+            m_forwarded = stop;
+        }
+        if (m_forwarded < to) {
+            m_batch.append(data + (m_forwarded - base), static_cast<std::size_t>(to - m_forwarded));
+            m_forwarded = to;
+        }
+    }
+
+    // Forwards the bytes before the pending span and the mask in place of the span.
+    void mask_pending(const char* data, std::uint64_t base) {
+        pass(m_mask_start, data, base);
+        m_batch.append(redaction_rules::mask);
+        m_forwarded = std::max(m_forwarded, m_mask_end);
+        m_masking = false;
+        ++m_secrets;
+    }
+
+public:
+    /**
+     * @param next Sink that receives the redacted stream
+     * @param rules Built redaction rules
+     */
+    redact_stage(sink& next, std::shared_ptr<const redaction_rules> rules)
+        : stage(next), m_rules(std::move(rules)), m_automaton(m_rules->automaton()) {
+        m_batch.reserve(8 * 1024);
+        for (unsigned c = 0; c < 256; ++c) {
+            m_starts[c] = m_automaton.next(aho_corasick::root, static_cast<unsigned char>(c)) != aho_corasick::root;
+        }
+    }
+
+    void write(const char* data, std::size_t size) override {
+        const std::uint64_t base = m_total;
+        const char* end = data + size;
+        for (const char* p = data; p < end; ++p) {
+            const std::uint64_t at = base + static_cast<std::uint64_t>(p - data);
+            if (m_token != token::none) {
+                if (m_token == token::leading_blanks && (*p == ' ' || *p == '\t')) {
+                    pass(at + 1, data, base);
+                    continue;
+                }
+                if (!ends_token(*p)) {
+                    if (m_token == token::leading_blanks) m_batch.append(redaction_rules::mask);
+                    m_token = token::inside;
+                    m_forwarded = at + 1;
+                    continue;
+                }
+                m_token = token::none;
+            }
+            if (m_state == aho_corasick::root) {
+                // Skip to the next byte that can start a rule.
+                while (p < end && !m_starts[static_cast<unsigned char>(*p)]) ++p;
+                if (p == end) break;
+            }
+            const std::uint64_t here = base + static_cast<std::uint64_t>(p - data);
+            m_state = m_automaton.next(m_state, static_cast<unsigned char>(*p));
+            const std::uint32_t id = m_automaton.match(m_state);
+            if (id != aho_corasick::no_match) {
+                const std::uint64_t start = here + 1 - m_automaton.length(id);
+                if (m_rules->is_prefix(id)) {
+                    // Forward the prefix itself, then mask the token that follows it.
+                    if (m_masking) mask_pending(data, base);
+                    pass(here + 1, data, base);
+                    m_token = token::leading_blanks;
+                    m_state = aho_corasick::root;
+                    ++m_tokens;
+                    continue;
+                }
+                if (m_masking) {
+                    m_mask_start = std::min(m_mask_start, start);
+                    m_mask_end = std::max(m_mask_end, here + 1);
+                } else {
+                    m_masking = true;
+                    m_mask_start = start;
+                    m_mask_end = here + 1;
+                }
+            }
+            // No secret yet to be matched can start before the current state's prefix.
+            if (m_masking && here + 1 - m_automaton.depth(m_state) >= m_mask_end) mask_pending(data, base);
+        }
+
+        // Hold back the bytes that may still be part of a secret.
+        const std::uint64_t stop = base + size;
+        std::uint64_t hold = stop - m_automaton.depth(m_state);
+        if (m_masking) hold = std::min(hold, m_mask_start);
+        pass(hold, data, base);
+        if (m_forwarded < base) {
+            m_held.erase(0, static_cast<std::size_t>(m_forwarded - (base - m_held.size())));
+            m_held.append(data, size);
+        } else {
+            m_held.assign(data + (m_forwarded - base), static_cast<std::size_t>(stop - m_forwarded));
+        }
+        m_total = stop;
+        if (!m_batch.empty()) {
+            m_next.write(m_batch.data(), m_batch.size());
+            m_batch.clear();
+        }
+    }
+
+    void finish() override {
+        // A pending span is a complete secret; other held bytes are an incomplete match.
+        if (m_masking) mask_pending(nullptr, m_total);
+        pass(m_total, nullptr, m_total);
+        m_held.clear();
+        if (!m_batch.empty()) {
+            m_next.write(m_batch.data(), m_batch.size());
+            m_batch.clear();
+        }
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".redact.secrets", m_secrets);
+        stats.add(prefix + ".redact.tokens", m_tokens);
+    }
+};
+
+} // namespace rkt
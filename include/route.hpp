@@ -0,0 +1,313 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "spdlog/fmt/fmt.h"
+
+#include "file.hpp"
+#include "filter.hpp"
+#include "framing.hpp"
+#include "sink.hpp"
+#include "statistics.hpp"
+
+namespace rkt {
+
+/**
+ * Data set that lines are routed to, with its own batching buffer.
+ *
+ * Lines are appended to the buffer and written to the file in one call
+ * when the buffer is full and when the target is flushed.
+ *
+ * This class is not thread safe.
+ */
+class route_target {
+private:
+    std::string m_name;
+    file m_file;
+    std::string m_buffer;
+    std::size_t m_capacity;
+    std::uint64_t m_lines{0};
+    std::uint64_t m_bytes{0};
+    std::uint64_t m_writes{0};
+
+public:
+    /**
+     * Opens the target.
+     *
+     * @param name DD name, e.g. "ERRORS", or a path name
+     * @param capacity Size of the batching buffer
+     * @throws std::runtime_error if the data set cannot be opened
+     */
+    route_target(std::string name, std::size_t capacity)
+        : m_name(std::move(name)),
+          m_file(data_set_name(m_name), "w"),
+          m_capacity(capacity) {
+        m_buffer.reserve(m_capacity);
+    }
+
+    /** Returns the name the target was opened with. */
+    const std::string& name() const noexcept { return m_name; }
+
+    /**
+     * Appends a line.
+     *
+     * @param line Line without its new line
+     * @param terminated Append a new line after it
+     */
+    void write_line(std::string_view line, bool terminated) {
+        m_buffer.append(line);
+        if (terminated) {
+            m_buffer.push_back('\n');
+            ++m_lines;
+        }
+        if (m_buffer.size() >= m_capacity) flush();
+    }
+
+    /** Writes the buffered lines to the file. */
+    void flush() {
+        if (m_buffer.empty()) return;
+        m_file.write(m_buffer.data(), m_buffer.size());
+        m_bytes += m_buffer.size();
+        ++m_writes;
+        m_buffer.clear();
+    }
+
+    /** Adds the target's counters to the step statistics. */
+    void report(statistics& stats) const {
+        stats.add("ROUTE." + m_name + ".lines", m_lines);
+        stats.add("ROUTE." + m_name + ".bytes_written", m_bytes);
+        stats.add("ROUTE." + m_name + ".writes", m_writes);
+    }
+};
+
+/**
+ * The route targets of a step, opened on first use and shared by every
+ * stage that routes lines, so STDOUT and STDERR can be routed to the same
+ * data set.
+ */
+class route_targets {
+private:
+    std::size_t m_capacity;
+    std::vector<std::unique_ptr<route_target>> m_targets;
+
+public:
+    /** Default size of each target's batching buffer. */
+    static constexpr std::size_t default_capacity = 64 * 1024;
+
+    /**
+     * @param capacity Size of each target's batching buffer
+     */
+    explicit route_targets(std::size_t capacity = default_capacity) : m_capacity(capacity) {}
+
+    /**
+     * Returns the target with a name, opening it if needed. Names that
+     * refer to the same data set, such as "errors" and "ERRORS", return the
+     * same target.
+     *
+     * @param name DD name or path name
+     * @throws std::runtime_error if the name is a DD of the step or the data set cannot be opened
+     */
+    route_target& get(const std::string& name) {
+        const std::string opened = data_set_name(name);
+        for (auto& t : m_targets) {
+            if (data_set_name(t->name()) == opened) return *t;
+        }
+        if (is_step_dd(name)) throw std::runtime_error(name + " is a data set of the step and cannot be a route target");
+        m_targets.push_back(std::make_unique<route_target>(name, m_capacity));
+        return *m_targets.back();
+    }
+
+    /** Returns true if a target refers to the same data set as a name. */
+    bool contains(const std::string& name) const {
+        const std::string opened = data_set_name(name);
+        for (const auto& t : m_targets) {
+            if (data_set_name(t->name()) == opened) return true;
+        }
+        return false;
+    }
+
+    /** Writes the buffered lines of every target. */
+    void flush() {
+        for (auto& t : m_targets) t->flush();
+    }
+
+    /** Adds the counters of every target to the step statistics. */
+    void report(statistics& stats) const {
+        for (const auto& t : m_targets) t->report(stats);
+    }
+};
+
+/**
+ * Rules that route lines to data sets by pattern.
+ *
+ * Each rule is "NAME PATTERN". A pattern starting with "^" matches lines
+ * that start with the rest of the pattern; "re:" starts a regular
+ * expression; any other pattern is a literal that matches anywhere in the
+ * line. Start-of-line rules are checked first, in order, by comparing the
+ * start of the line. The other patterns are matched together by a
+ * pattern_set, so the literals cost a single Aho-Corasick pass behind the
+ * memchr prefilter; when several literals match, the one that ends first
+ * wins, and regular expressions are tried last, in order.
+ *
+ * Rules are immutable once loaded and can be shared by several stages.
+ */
+class route_rules {
+private:
+    struct rule {
+        std::string text;
+        route_target* target;
+    };
+
+    std::vector<rule> m_rules;
+    std::vector<std::pair<std::string, std::size_t>> m_starts;
+    pattern_set m_patterns;
+    std::vector<std::size_t> m_pattern_rules;
+
+public:
+    /** Index returned when no rule matches. */
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    /**
+     * Reads rules from a file, one per line.
+     *
+     * Trailing blanks are removed. Empty lines and lines starting with "#"
+     * are ignored.
+     *
+     * @param name Path or DD name of the file, e.g. "//DD:ROUTES"
+     * @param targets Route targets, opened as rules refer to them
+     * @throws std::runtime_error if the file cannot be read or a rule is malformed
+     */
+    static std::shared_ptr<const route_rules> load(const std::string& name, route_targets& targets) {
+        auto result = std::make_shared<route_rules>();
+        file f(name, "r");
+        FILE* fp = static_cast<FILE*>(f);
+        char line[4096];
+        while (std::fgets(line, sizeof(line), fp)) {
+            std::string text(line);
+            while (!text.empty() && (text.back() == '\n' || text.back() == ' ')) text.pop_back();
+            if (text.empty() || text[0] == '#') continue;
+            const std::size_t blank = text.find(' ');
+            if (blank == 0 || blank == std::string::npos || blank + 1 == text.size()) {
+                throw std::runtime_error("Route rule must be NAME PATTERN: " + text);
+            }
+            const std::string pattern = text.substr(blank + 1);
+            const std::size_t index = result->m_rules.size();
+            result->m_rules.push_back({text, &targets.get(text.substr(0, blank))});
+            if (pattern[0] == '^') {
+                if (pattern.size() == 1) throw std::runtime_error("Route rule has an empty pattern: " + text);
+                result->m_starts.emplace_back(pattern.substr(1), index);
+            } else {
+                result->m_patterns.add(pattern);
+                result->m_pattern_rules.push_back(index);
+            }
+        }
+        if (result->m_rules.empty()) throw std::runtime_error(name + " contains no route rules");
+        result->m_patterns.build();
+        return result;
+    }
+
+    /** Returns the number of rules. */
+    std::size_t size() const noexcept { return m_rules.size(); }
+
+    /** Returns the text of a rule. */
+    const std::string& text(std::size_t index) const { return m_rules[index].text; }
+
+    /** Returns the target of a rule. */
+    route_target& target(std::size_t index) const { return *m_rules[index].target; }
+
+    /**
+     * Finds the rule that routes a line.
+     *
+     * @param line Line without its new line
+     * @return index of the rule, or npos if the line is not routed
+     */
+    std::size_t match(std::string_view line) const {
+        for (const auto& [prefix, index] : m_starts) {
+            if (line.size() >= prefix.size() && line.compare(0, prefix.size(), prefix) == 0) return index;
+        }
+        if (m_patterns.size() == 0) return npos;
+        bool prefiltered;
+        const std::size_t pattern = m_patterns.match(line, prefiltered);
+        return pattern == pattern_set::npos ? npos : m_pattern_rules[pattern];
+    }
+};
+
+/**
+ * Stage that routes lines to other data sets by route_rules.
+ *
+ * Lines no rule matches are passed on; the others are appended to their
+ * target's batching buffer. Lines are framed in place, so routing makes no
+ * allocation per line, and a line split between reads is routed as a
+ * whole.
+ */
+class route_stage : public stage {
+private:
+    std::shared_ptr<const route_rules> m_rules;
+    line_framer m_framer;
+    std::string m_batch;
+    bool m_continuation{false};
+    std::size_t m_decision{route_rules::npos};
+    std::vector<std::uint64_t> m_hits;
+    std::uint64_t m_lines{0};
+
+    void on_line(std::string_view line, bool terminated) {
+        // The pieces of an overlong line share the decision made for the first piece.
+        if (!m_continuation) {
+            ++m_lines;
+            m_decision = m_rules->match(line);
+            if (m_decision != route_rules::npos) ++m_hits[m_decision];
+        }
+        m_continuation = !terminated;
+        if (m_decision != route_rules::npos) {
+            m_rules->target(m_decision).write_line(line, terminated);
+            return;
+        }
+        m_batch.append(line);
+        if (terminated) m_batch.push_back('\n');
+    }
+
+    void forward() {
+        if (m_batch.empty()) return;
+        m_next.write(m_batch.data(), m_batch.size());
+        m_batch.clear();
+    }
+
+public:
+    /**
+     * @param next Sink that receives the lines that are not routed
+     * @param rules Rules to apply
+     */
+    route_stage(sink& next, std::shared_ptr<const route_rules> rules)
+        : stage(next), m_rules(std::move(rules)), m_hits(m_rules->size(), 0) {
+        m_batch.reserve(8 * 1024);
+    }
+
+    void write(const char* data, std::size_t size) override {
+        m_framer.feed(data, size, [this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        forward();
+    }
+
+    void finish() override {
+        m_framer.flush([this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        forward();
+        for (std::size_t i = 0; i < m_rules->size(); ++i) m_rules->target(i).flush();
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".route.lines", m_lines);
+        for (std::size_t i = 0; i < m_hits.size(); ++i) {
+            stats.add(fmt::format("{}.route.rule.{}", prefix, i + 1), fmt::format("{} {}", m_hits[i], m_rules->text(i)));
+        }
+    }
+};
+
+} // namespace rkt
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+
+#include "spdlog/fmt/fmt.h"
+
+#include "errors.hpp"
+#include "file.hpp"
+#include "framing.hpp"
+#include "sink.hpp"
+#include "timestamp.hpp"
+
+namespace rkt {
+
+/**
+ * Terminal sink that writes a stream as a series of numbered segment files.
+ *
+ * Segments are named PREFIX.00001, PREFIX.00002 and so on. A segment is
+ * written as PREFIX.NNNNN.part and renamed to its final name when it is
+ * complete, so a consumer that only looks at final names never sees a
+ * partial segment. Segments end at line boundaries: when a chunk would
+ * take a segment past the size limit, the segment ends at the last line
+ * boundary in the chunk that fits, or if there is none, at the end of the
+ * line in progress, so a segment exceeds the limit by at most one line. A
+ * segment older than the age limit ends at the next line boundary; the age
+ * is checked when output arrives and, through expire(), while none does.
+ *
+ * After each rename a line is appended to PREFIX.manifest:
+ * "S NAME BYTES LINES FIRST_LINE START END", with the times in seconds since
+ * the epoch. "E SEGMENTS BYTES LINES" is appended when the stream ends.
+ */
+class segment_sink : public sink {
+private:
+    std::string m_prefix;
+    std::uint64_t m_max_bytes;
+    std::int64_t m_max_ns;
+    file m_manifest;
+    file m_file;
+    std::string m_part;
+    std::string m_name;
+    std::uint64_t m_number{0};
+    std::uint64_t m_bytes{0};
+    std::uint64_t m_lines{0};
+    std::uint64_t m_first_line{1};
+    std::int64_t m_start_ns{0};
+    bool m_at_boundary{true};
+    std::uint64_t m_total_bytes{0};
+    std::uint64_t m_total_lines{0};
+    std::uint64_t m_writes{0};
+
+    void open_segment(std::int64_t now) {
+        m_name = fmt::format("{}.{:05}", m_prefix, ++m_number);
+        m_part = m_name + ".part";
+        m_file.open(m_part, "w");
+        m_bytes = 0;
+        m_lines = 0;
+        m_start_ns = now;
+    }
+
+    void close_segment() {
+        m_file.close();
+        if (std::rename(m_part.c_str(), m_name.c_str()) != 0) throwError("Error renaming " + m_part);
+        std::string entry = fmt::format("S {} {} {} {} {} {}\n", m_name, m_bytes, m_lines, m_first_line,
+                                        m_start_ns / 1000000000, coarse_clock_ns() / 1000000000);
+        m_manifest.write(entry.data(), entry.size());
+        std::fflush(static_cast<FILE*>(m_manifest));
+        m_first_line += m_lines;
+    }
+
+    void append(const char* data, std::size_t size, std::uint64_t lines) {
+        if (size == 0) return;
+        m_file.write(data, size);
+        m_bytes += size;
+        m_lines += lines;
+        m_total_bytes += size;
+        m_total_lines += lines;
+        m_at_boundary = data[size - 1] == '\n';
+        ++m_writes;
+    }
+
+public:
+    /**
+     * Opens the manifest.
+     *
+     * @param prefix Path name that segment names start with, e.g. "/u/logs/job.out"
+     * @param max_bytes Size limit of a segment, or 0 for none
+     * @param max_seconds Age limit of a segment, or 0 for none
+     * @throws std::runtime_error if the manifest cannot be opened
+     */
+    segment_sink(std::string prefix, std::uint64_t max_bytes, std::int64_t max_seconds)
+        : m_prefix(std::move(prefix)), m_max_bytes(max_bytes), m_max_ns(max_seconds * 1000000000),
+          m_manifest(m_prefix + ".manifest", "w") {
+        static constexpr const char* header = "# rktbatch segment manifest v1\n";
+        m_manifest.write(header, std::char_traits<char>::length(header));
+        std::fflush(static_cast<FILE*>(m_manifest));
+    }
+
+    void write(const char* data, std::size_t size) override {
+        const char* end = data + size;
+        while (data < end) {
+            const std::int64_t now = coarse_clock_ns();
+            if (!m_file.is_open()) open_segment(now);
+            const bool aged = m_max_ns > 0 && now - m_start_ns >= m_max_ns;
+            std::size_t room = static_cast<std::size_t>(end - data);
+            if (aged) {
+                room = 0;
+            } else if (m_max_bytes > 0) {
+                room = m_max_bytes > m_bytes ? std::min<std::uint64_t>(room, m_max_bytes - m_bytes) : 0;
+            }
+
+            // Count the lines that fit, remembering where the last one ends.
+            const char* limit = data + room;
+            const char* last = nullptr;
+            std::uint64_t lines = 0;
+            for (const char* p = data; (p = find_newline(p, limit)) != limit; ++p) {
+                last = p;
+                ++lines;
+            }
+            if (limit == end && !aged && (m_max_bytes == 0 || m_bytes + room < m_max_bytes)) {
+                append(data, room, lines);
+                return;
+            }
+            if (last) {
+                append(data, static_cast<std::size_t>(last + 1 - data), lines);
+                data = last + 1;
+            } else if (!m_at_boundary || m_bytes == 0) {
+                // Nothing fits; end the segment after the line in progress.
+                const char* nl = find_newline(limit, end);
+                if (nl == end) {
+                    append(data, static_cast<std::size_t>(end - data), 0);
+                    return;
+                }
+                append(data, static_cast<std::size_t>(nl + 1 - data), 1);
+                data = nl + 1;
+            }
+            close_segment();
+        }
+    }
+
+    /**
+     * Ends the open segment if it has reached the age limit and ends with a
+     * whole line. The owner calls this while no output arrives, so the last
+     * segment of a burst is completed without waiting for more output.
+     */
+    void expire() {
+        if (m_max_ns == 0 || !m_file.is_open() || m_bytes == 0 || !m_at_boundary) return;
+        if (coarse_clock_ns() - m_start_ns >= m_max_ns) close_segment();
+    }
+
+    void finish() override {
+        if (m_file.is_open()) close_segment();
+        std::string entry = fmt::format("E {} {} {}\n", m_number, m_total_bytes, m_total_lines);
+        m_manifest.write(entry.data(), entry.size());
+        std::fflush(static_cast<FILE*>(m_manifest));
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".bytes_written", m_total_bytes);
+        stats.add(prefix + ".writes", m_writes);
+        stats.add(prefix + ".segments", m_number);
+    }
+};
+
+} // namespace rkt
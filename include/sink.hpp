@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "file.hpp"
+#include "statistics.hpp"
+
+namespace rkt {
+
+/**
+ * Destination for data relayed from the child process.
+ *
+ * Sinks are chained together into a pipeline. A stage inspects or
+ * transforms the data it receives and forwards the result to the next
+ * sink in the chain. The last sink in a chain normally writes to an
+ * rkt::file.
+ *
+ * Operations throw on error. This class is not thread safe.
+ */
+class sink {
+public:
+    virtual ~sink() = default;
+
+    /**
+     * Consumes a chunk of relayed data.
+     *
+     * @param data Source buffer
+     * @param size Number of bytes in the buffer
+     */
+    virtual void write(const char* data, std::size_t size) = 0;
+
+    /**
+     * Called once when relaying has ended.
+     *
+     * Sinks that hold data back must write it out here. Stages forward
+     * the call to the next sink after flushing their own data.
+     */
+    virtual void finish() {}
+
+    /**
+     * Adds the sink's counters to the step statistics.
+     *
+     * @param stats Statistics to add to
+     * @param prefix Name of the stream the sink belongs to, e.g. "STDOUT"
+     */
+    virtual void report(statistics& /*stats*/, const std::string& /*prefix*/) const {}
+};
+
+/**
+ * Terminal sink that writes to an rkt::file.
+ *
+ * The file is not owned and must outlive the sink.
+ */
+class file_sink : public sink {
+private:
+    const file& m_file;
+    std::uint64_t m_bytes{0};
+    std::uint64_t m_writes{0};
+
+public:
+    /**
+     * @param f Open file to write to
+     */
+    explicit file_sink(const file& f) : m_file(f) {}
+
+    void write(const char* data, std::size_t size) override {
+        if (size == 0) return;
+        m_file.write(data, size);
+        m_bytes += size;
+        ++m_writes;
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".bytes_written", m_bytes);
+        stats.add(prefix + ".writes", m_writes);
+    }
+};
+
+/**
+ * Base class for sinks that forward to another sink.
+ *
+ * The next sink is not owned and must outlive the stage.
+ */
+class stage : public sink {
+protected:
+    sink& m_next;
+
+public:
+    /**
+     * @param next Sink that receives the output of this stage
+     */
+    explicit stage(sink& next) : m_next(next) {}
+
+    void finish() override { m_next.finish(); }
+};
+
+/**
+ * Ordered chain of stages in front of a terminal sink.
+ *
+ * A pipeline starts with only its terminal sink. Each call to push()
+ * constructs a new stage in front of the current head, so the stage pushed
+ * last sees the data first. The pipeline owns the stages it constructs but
+ * not the terminal sink.
+ *
+ * This class is not thread safe.
+ */
+class pipeline {
+private:
+    std::string m_name;
+    sink& m_terminal;
+    sink* m_head;
+    std::vector<std::unique_ptr<sink>> m_stages;
+
+public:
+    /**
+     * @param name Stream name used to prefix statistics, e.g. "STDOUT"
+     * @param terminal Sink at the end of the chain
+     */
+    pipeline(std::string name, sink& terminal)
+        : m_name(std::move(name)), m_terminal(terminal), m_head(&terminal) {}
+
+    pipeline(pipeline const&) = delete;
+    pipeline& operator=(pipeline const&) = delete;
+
+    /**
+     * Constructs a stage in front of the current head.
+     *
+     * The stage is constructed with the current head as its first
+     * argument followed by args.
+     *
+     * @return reference to the new stage
+     */
+    template <typename T, typename... Args>
+    T& push(Args&&... args) {
+        auto s = std::make_unique<T>(*m_head, std::forward<Args>(args)...);
+        T& ref = *s;
+        m_stages.push_back(std::move(s));
+        m_head = &ref;
+        return ref;
+    }
+
+    /** Returns the stream name. */
+    const std::string& name() const noexcept { return m_name; }
+
+    /** Returns the sink that receives data written to the pipeline. */
+    sink& head() noexcept { return *m_head; }
+
+    /** Returns true if any stage was pushed in front of the terminal sink. */
+    bool has_stages() const noexcept { return !m_stages.empty(); }
+
+    /** Writes data to the first stage of the pipeline. */
+    void write(const char* data, std::size_t size) { m_head->write(data, size); }
+
+    /** Signals the end of the stream to every stage. */
+    void finish() { m_head->finish(); }
+
+    /**
+     * Adds the statistics of every stage and the terminal sink,
+     * in data flow order.
+     */
+    void report(statistics& stats) const {
+        for (auto it = m_stages.rbegin(); it != m_stages.rend(); ++it) {
+            (*it)->report(stats, m_name);
+        }
+        m_terminal.report(stats, m_name);
+    }
+};
+
+} // namespace rkt
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "file.hpp"
+#include "statistics.hpp"
+
+namespace rkt {
+
+/**
+ * Origin of data relayed to the child process.
+ *
+ * Sources are chained together into a source_pipeline. A source stage
+ * reads from the source in front of it, transforms the data and hands
+ * the result to its caller. The first source in a chain normally reads
+ * from an rkt::file.
+ *
+ * Operations throw on error. This class is not thread safe.
+ */
+class source {
+public:
+    virtual ~source() = default;
+
+    /**
+     * Reads up to the specified number of bytes.
+     *
+     * @param buffer Destination buffer
+     * @param size Maximum number of bytes to read
+     * @return number of bytes read, or 0 at end of data
+     */
+    virtual std::size_t read(char* buffer, std::size_t size) = 0;
+
+    /**
+     * Adds the source's counters to the step statistics.
+     *
+     * @param stats Statistics to add to
+     * @param prefix Name of the stream the source belongs to, e.g. "STDIN"
+     */
+    virtual void report(statistics& /*stats*/, const std::string& /*prefix*/) const {}
+};
+
+/**
+ * Source that reads from an rkt::file.
+ *
+ * The file is not owned and must outlive the source.
+ */
+class file_source : public source {
+private:
+    const file& m_file;
+    std::uint64_t m_bytes{0};
+
+public:
+    /**
+     * @param f Open file to read from
+     */
+    explicit file_source(const file& f) : m_file(f) {}
+
+    std::size_t read(char* buffer, std::size_t size) override {
+        std::size_t n = m_file.read(buffer, size);
+        m_bytes += n;
+        return n;
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".bytes_read", m_bytes);
+    }
+};
+
+/**
+ * Base class for sources that read from another source.
+ *
+ * The upstream source is not owned and must outlive the stage.
+ */
+class source_stage : public source {
+protected:
+    source& m_upstream;
+
+public:
+    /**
+     * @param upstream Source this stage reads from
+     */
+    explicit source_stage(source& upstream) : m_upstream(upstream) {}
+};
+
+/**
+ * Ordered chain of source stages behind an origin source.
+ *
+ * A source pipeline starts with only its origin. Each call to push()
+ * constructs a new stage reading from the current head, so the stage
+ * pushed last delivers the data to the caller. The pipeline owns the
+ * stages it constructs but not the origin.
+ *
+ * This class is not thread safe.
+ */
+class source_pipeline {
+private:
+    std::string m_name;
+    source& m_origin;
+    source* m_head;
+    std::vector<std::unique_ptr<source>> m_stages;
+
+public:
+    /**
+     * @param name Stream name used to prefix statistics, e.g. "STDIN"
+     * @param origin Source at the start of the chain
+     */
+    source_pipeline(std::string name, source& origin)
+        : m_name(std::move(name)), m_origin(origin), m_head(&origin) {}
+
+    source_pipeline(source_pipeline const&) = delete;
+    source_pipeline& operator=(source_pipeline const&) = delete;
+
+    /**
+     * Constructs a stage reading from the current head.
+     *
+     * The stage is constructed with the current head as its first
+     * argument followed by args.
+     *
+     * @return reference to the new stage
+     */
+    template <typename T, typename... Args>
+    T& push(Args&&... args) {
+        auto s = std::make_unique<T>(*m_head, std::forward<Args>(args)...);
+        T& ref = *s;
+        m_stages.push_back(std::move(s));
+        m_head = &ref;
+        return ref;
+    }
+
+    /** Reads from the last stage of the pipeline. */
+    std::size_t read(char* buffer, std::size_t size) { return m_head->read(buffer, size); }
+
+    /** Returns true if any stage was pushed after the origin. */
+    bool has_stages() const noexcept { return !m_stages.empty(); }
+
+    /**
+     * Adds the statistics of the origin and every stage, in data flow order.
+     */
+    void report(statistics& stats) const {
+        m_origin.report(stats, m_name);
+        for (const auto& s : m_stages) s->report(stats, m_name);
+    }
+};
+
+} // namespace rkt
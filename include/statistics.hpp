@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+#include "spdlog/fmt/fmt.h"
+
+#include "file.hpp"
+
+namespace rkt {
+
+/**
+ * Ordered collection of named step statistics.
+ *
+ * Relay stages add counters to the collection when the step ends and the
+ * collection is then written to the log (SYSPRINT) and, optionally, to a
+ * metrics file. Names are dotted paths
+ * prefixed with the stream they describe, e.g. "STDOUT.bytes_written".
+ * Entries are kept in insertion order so related values appear together.
+ *
+ * This class is not thread safe.
+ */
+class statistics {
+private:
+    std::vector<std::pair<std::string, std::string>> m_entries;
+
+public:
+    /**
+     * Adds a named value. The value is formatted immediately.
+     *
+     * @param name Dotted statistic name
+     * @param value Any value that can be formatted by fmt
+     */
+    template <typename T>
+    void add(std::string name, const T& value) {
+        m_entries.emplace_back(std::move(name), fmt::format("{}", value));
+    }
+
+    /**
+     * Returns the collected entries in insertion order.
+     */
+    const std::vector<std::pair<std::string, std::string>>& entries() const noexcept {
+        return m_entries;
+    }
+
+    /**
+     * Writes every entry to the log.
+     *
+     * @param level Log level of the entries
+     */
+    void log(spdlog::level::level_enum level = spdlog::level::info) const {
+        for (const auto& [name, value] : m_entries) {
+            spdlog::log(level, "{} = {}", name, value);
+        }
+    }
+
+    /**
+     * Writes every entry to a file as one name=value line.
+     *
+     * @param f Open file to write to
+     * @throws on write error
+     */
+    void write(const file& f) const {
+        for (const auto& [name, value] : m_entries) {
+            std::string line = fmt::format("{}={}\n", name, value);
+            f.write(line.data(), line.size());
+        }
+    }
+};
+
+} // namespace rkt
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "file.hpp"
+#include "sink.hpp"
+#include "statistics.hpp"
+
+namespace rkt {
+
+/**
+ * Additional destination of a relayed stream, written by its own thread.
+ *
+ * Chunks are queued as shared, immutable buffers, so every target of a
+ * stream refers to the same copy. The queue holds at most capacity bytes;
+ * when it is full the relay either waits for the writer or, in drop mode,
+ * discards the chunk for this target only, so a slow target holds up the
+ * others by at most its queue. A write error is raised on the next push or
+ * on close.
+ *
+ * push() and close() must be called from one thread.
+ */
+class tee_target {
+public:
+    /** A chunk of relayed data shared by the targets of a stream. */
+    using chunk = std::shared_ptr<const std::string>;
+
+private:
+    std::string m_name;
+    file m_file;
+    std::size_t m_capacity;
+    bool m_drop;
+
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::condition_variable m_space;
+    std::deque<chunk> m_queue;
+    std::size_t m_queued{0};
+    bool m_closing{false};
+    std::exception_ptr m_error;
+
+    // Updated by the writer thread; read after it is joined.
+    std::uint64_t m_bytes{0};
+    std::uint64_t m_writes{0};
+    // Updated by the relay thread.
+    std::uint64_t m_waits{0};
+    std::uint64_t m_wait_ns{0};
+    std::uint64_t m_dropped_chunks{0};
+    std::uint64_t m_dropped_bytes{0};
+    std::size_t m_max_queued{0};
+
+    std::thread m_thread;
+
+    void work() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_ready.wait(lock, [this] { return m_closing || !m_queue.empty(); });
+            if (m_queue.empty()) return;
+            chunk c = m_queue.front();
+            lock.unlock();
+            try {
+                m_file.write(c->data(), c->size());
+                m_bytes += c->size();
+                ++m_writes;
+            } catch (...) {
+                lock.lock();
+                m_error = std::current_exception();
+                m_queue.clear();
+                m_queued = 0;
+                m_space.notify_all();
+                return;
+            }
+            lock.lock();
+            m_queue.pop_front();
+            m_queued -= c->size();
+            m_space.notify_all();
+        }
+    }
+
+    void stop() noexcept {
+        if (!m_thread.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closing = true;
+        }
+        m_ready.notify_one();
+        m_thread.join();
+    }
+
+public:
+    /**
+     * Opens the target and starts its writer thread.
+     *
+     * @param name DD name, e.g. "ARCHIVE", or a path name
+     * @param capacity Largest number of bytes queued
+     * @param drop Discard chunks when the queue is full instead of waiting
+     * @throws std::runtime_error if the data set cannot be opened
+     */
+    tee_target(std::string name, std::size_t capacity, bool drop)
+        : m_name(std::move(name)),
+          m_file(data_set_name(m_name), "w"),
+          m_capacity(capacity),
+          m_drop(drop) {
+        m_thread = std::thread([this] { work(); });
+    }
+
+    tee_target(tee_target const&) = delete;
+    tee_target& operator=(tee_target const&) = delete;
+
+    /** Writes the queued chunks and joins the writer thread. */
+    ~tee_target() { stop(); }
+
+    /** Returns the name the target was opened with. */
+    const std::string& name() const noexcept { return m_name; }
+
+    /**
+     * Queues a chunk.
+     *
+     * A chunk larger than the queue is accepted when the queue is empty.
+     *
+     * @param c Chunk to write
+     * @throws the error of an earlier write
+     */
+    void push(const chunk& c) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_error) std::rethrow_exception(m_error);
+        auto full = [this, &c] { return !m_queue.empty() && m_queued + c->size() > m_capacity; };
+        if (full()) {
+            if (m_drop) {
+                ++m_dropped_chunks;
+                m_dropped_bytes += c->size();
+                return;
+            }
+            auto start = std::chrono::steady_clock::now();
+            ++m_waits;
+            m_space.wait(lock, [this, &full] { return m_error || !full(); });
+            m_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            if (m_error) std::rethrow_exception(m_error);
+        }
+        m_queue.push_back(c);
+        m_queued += c->size();
+        if (m_queued > m_max_queued) m_max_queued = m_queued;
+        lock.unlock();
+        m_ready.notify_one();
+    }
+
+    /**
+     * Writes the queued chunks and joins the writer thread.
+     *
+     * @throws the error of a failed write
+     */
+    void close() {
+        stop();
+        if (m_error) std::rethrow_exception(m_error);
+    }
+
+    /**
+     * Adds the target's counters to the step statistics.
+     *
+     * @param stats Statistics to add to
+     * @param prefix Name prefix, e.g. "STDOUT.tee"
+     */
+    void report(statistics& stats, const std::string& prefix) const {
+        std::string name = prefix + "." + m_name;
+        stats.add(name + ".bytes_written", m_bytes);
+        stats.add(name + ".writes", m_writes);
+        stats.add(name + ".queue_max_bytes", m_max_queued);
+        stats.add(name + ".queue_full_waits", m_waits);
+        stats.add(name + ".queue_full_wait_ns", m_wait_ns);
+        if (m_drop) {
+            stats.add(name + ".chunks_dropped", m_dropped_chunks);
+            stats.add(name + ".bytes_dropped", m_dropped_bytes);
+        }
+    }
+};
+
+/**
+ * Stage that also writes a stream to other data sets.
+ *
+ * Each chunk is copied once into a shared buffer that is queued to every
+ * target, and is forwarded to the next sink as it is, so the stream is read
+ * once however many copies are written.
+ */
+class tee_stage : public stage {
+private:
+    std::vector<std::unique_ptr<tee_target>> m_targets;
+    std::uint64_t m_chunks{0};
+
+public:
+    /**
+     * @param next Sink that receives the unchanged data
+     * @param names DD names or path names of the targets
+     * @param capacity Largest number of bytes queued for each target
+     * @param drop Discard chunks for a target whose queue is full instead of waiting
+     * @throws std::runtime_error if a name is a DD of the step or a data set cannot be opened
+     */
+    tee_stage(sink& next, const std::vector<std::string>& names, std::size_t capacity, bool drop) : stage(next) {
+        for (const auto& name : names) {
+            if (is_step_dd(name)) throw std::runtime_error(name + " is a data set of the step and cannot be a tee target");
+            m_targets.push_back(std::make_unique<tee_target>(name, capacity, drop));
+        }
+    }
+
+    void write(const char* data, std::size_t size) override {
+        if (size > 0) {
+            auto c = std::make_shared<const std::string>(data, size);
+            for (auto& t : m_targets) t->push(c);
+            ++m_chunks;
+        }
+        m_next.write(data, size);
+    }
+
+    void finish() override {
+        for (auto& t : m_targets) t->close();
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".tee.chunks", m_chunks);
+        for (const auto& t : m_targets) t->report(stats, prefix + ".tee");
+    }
+};
+
+} // namespace rkt
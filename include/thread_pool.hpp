@@ -0,0 +1,156 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "statistics.hpp"
+
+namespace rkt {
+
+/**
+ * Fixed size pool of worker threads with work stealing.
+ *
+ * Every worker owns a task queue. Submitted tasks are dealt to the queues
+ * round robin. A worker runs tasks from the back of its own queue and, when
+ * that is empty, steals from the front of the other queues, so a worker
+ * held up by a slow task does not leave its queued tasks waiting.
+ *
+ * Tasks must not throw; report failures through a promise or similar.
+ * The destructor runs every queued task before joining the workers.
+ *
+ * submit() is thread safe.
+ */
+class work_stealing_pool {
+private:
+    struct worker_queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        std::atomic<std::uint64_t> executed{0};
+        std::atomic<std::uint64_t> stolen{0};
+    };
+
+    std::vector<std::unique_ptr<worker_queue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::atomic<std::size_t> m_next{0};
+    std::mutex m_idle_mutex;
+    std::condition_variable m_idle;
+    std::size_t m_pending{0};
+    bool m_stop{false};
+
+    bool pop(worker_queue& q, std::function<void()>& task, bool front) {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty()) return false;
+        if (front) {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        } else {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        }
+        return true;
+    }
+
+    bool take(std::size_t id, std::function<void()>& task) {
+        worker_queue& own = *m_queues[id];
+        if (pop(own, task, false)) return true;
+        for (std::size_t i = 1; i < m_queues.size(); ++i) {
+            if (pop(*m_queues[(id + i) % m_queues.size()], task, true)) {
+                ++own.stolen;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(std::size_t id) {
+        while (true) {
+            std::function<void()> task;
+            if (take(id, task)) {
+                {
+                    std::lock_guard<std::mutex> lock(m_idle_mutex);
+                    --m_pending;
+                }
+                task();
+                ++m_queues[id]->executed;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_idle_mutex);
+            m_idle.wait(lock, [this] { return m_stop || m_pending > 0; });
+            if (m_stop && m_pending == 0) return;
+        }
+    }
+
+public:
+    /**
+     * Starts the worker threads.
+     *
+     * @param threads Number of workers; at least one is started
+     */
+    explicit work_stealing_pool(std::size_t threads) {
+        if (threads == 0) threads = 1;
+        for (std::size_t i = 0; i < threads; ++i) m_queues.push_back(std::make_unique<worker_queue>());
+        for (std::size_t i = 0; i < threads; ++i) m_threads.emplace_back([this, i] { work(i); });
+    }
+
+    work_stealing_pool(work_stealing_pool const&) = delete;
+    work_stealing_pool& operator=(work_stealing_pool const&) = delete;
+
+    /**
+     * Runs the remaining tasks and joins the workers.
+     */
+    ~work_stealing_pool() {
+        {
+            std::lock_guard<std::mutex> lock(m_idle_mutex);
+            m_stop = true;
+        }
+        m_idle.notify_all();
+        for (auto& t : m_threads) t.join();
+    }
+
+    /** Returns the number of worker threads. */
+    std::size_t size() const noexcept { return m_threads.size(); }
+
+    /**
+     * Queues a task.
+     *
+     * @param task Task to run on a worker thread
+     */
+    void submit(std::function<void()> task) {
+        // Count the task before queueing it so a worker can never take it first.
+        {
+            std::lock_guard<std::mutex> lock(m_idle_mutex);
+            ++m_pending;
+        }
+        worker_queue& q = *m_queues[m_next++ % m_queues.size()];
+        {
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.tasks.push_back(std::move(task));
+        }
+        m_idle.notify_one();
+    }
+
+    /**
+     * Adds the number of tasks each worker ran and stole.
+     *
+     * @param stats Statistics to add to
+     * @param prefix Name prefix, e.g. "STDOUT.compress"
+     */
+    void report(statistics& stats, const std::string& prefix) const {
+        for (std::size_t i = 0; i < m_queues.size(); ++i) {
+            std::string name = prefix + ".worker" + std::to_string(i);
+            stats.add(name + ".tasks", m_queues[i]->executed.load());
+            stats.add(name + ".stolen", m_queues[i]->stolen.load());
+        }
+    }
+};
+
+} // namespace rkt
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <string_view>
+
+#include <sys/time.h>
+
+#include "spdlog/fmt/fmt.h"
+
+#include "framing.hpp"
+#include "sink.hpp"
+
+namespace rkt {
+
+/**
+ * Reads the wall clock as cheaply as the platform allows.
+ *
+ * Uses CLOCK_REALTIME_COARSE where it exists, which is served from memory
+ * without a system call at a resolution of a few milliseconds, and
+ * gettimeofday() elsewhere.
+ *
+ * @return nanoseconds since the epoch
+ */
+inline std::int64_t coarse_clock_ns() noexcept {
+#ifdef CLOCK_REALTIME_COARSE
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return std::int64_t{ts.tv_sec} * 1000000000 + ts.tv_nsec;
+#else
+    timeval tv;
+    gettimeofday(&tv, nullptr);
+    return std::int64_t{tv.tv_sec} * 1000000000 + std::int64_t{tv.tv_usec} * 1000;
+#endif
+}
+
+/**
+ * Local time formatted as "YYYY-MM-DD HH:MM:SS.mmm ".
+ *
+ * The text is kept between calls. The milliseconds are patched in place
+ * when they change and the date and time are only formatted again when
+ * the second changes, so most calls cost a comparison.
+ *
+ * This class is not thread safe.
+ */
+class timestamp_text {
+private:
+    char m_text[24] = {};
+    std::int64_t m_second{-1};
+    std::int64_t m_milli{-1};
+    std::uint64_t m_formats{0};
+
+public:
+    /** Length of the text, including the trailing blank. */
+    static constexpr std::size_t size = sizeof(m_text);
+
+    /**
+     * Returns the text for a time.
+     *
+     * @param ns Nanoseconds since the epoch
+     * @return view of the text, valid until the next call
+     */
+    std::string_view at(std::int64_t ns) {
+        const std::int64_t milli = ns / 1000000;
+        if (milli != m_milli) {
+            m_milli = milli;
+            const std::int64_t second = milli / 1000;
+            if (second != m_second) {
+                m_second = second;
+                std::time_t t = static_cast<std::time_t>(second);
+                std::tm tm;
+                localtime_r(&t, &tm);
+                std::strftime(m_text, sizeof(m_text), "%Y-%m-%d %H:%M:%S", &tm);
+                m_text[19] = '.';
+                m_text[23] = ' ';
+                ++m_formats;
+            }
+            const auto ms = static_cast<int>(milli % 1000);
+            m_text[20] = static_cast<char>('0' + ms / 100);
+            m_text[21] = static_cast<char>('0' + ms / 10 % 10);
+            m_text[22] = static_cast<char>('0' + ms % 10);
+        }
+        return std::string_view(m_text, size);
+    }
+
+    /** Returns the number of times the date and time were formatted. */
+    std::uint64_t formats() const noexcept { return m_formats; }
+};
+
+/**
+ * Stage that prefixes every line with the time it was relayed.
+ *
+ * The clock is read once per chunk, so every line that starts in a chunk
+ * gets the time the chunk was read from the child. A line that spans
+ * chunks gets the time of the chunk holding its first byte. The prefixed
+ * chunk is assembled with memcpy in a reusable buffer and forwarded with
+ * one write.
+ */
+class timestamp_sink : public stage {
+private:
+    timestamp_text m_text;
+    std::string m_buffer;
+    bool m_line_start{true};
+    std::uint64_t m_lines{0};
+
+public:
+    /**
+     * @param next Sink that receives the prefixed lines
+     */
+    explicit timestamp_sink(sink& next) : stage(next) {
+        m_buffer.reserve(8 * 1024);
+    }
+
+    void write(const char* data, std::size_t size) override {
+        if (size == 0) return;
+        const std::string_view prefix = m_text.at(coarse_clock_ns());
+        const char* end = data + size;
+
+        // Count the lines first so the buffer is sized once and filled with memcpy.
+        std::size_t lines = m_line_start ? 1 : 0;
+        for (const char* p = data; (p = find_newline(p, end)) != end; ++p) {
+            if (p + 1 != end) ++lines;
+        }
+        m_buffer.resize(size + lines * prefix.size());
+        m_lines += lines;
+
+        char* out = m_buffer.data();
+        while (data < end) {
+            if (m_line_start) {
+                std::memcpy(out, prefix.data(), prefix.size());
+                out += prefix.size();
+                m_line_start = false;
+            }
+            const char* nl = find_newline(data, end);
+            const char* next = nl == end ? end : nl + 1;
+            std::memcpy(out, data, next - data);
+            out += next - data;
+            data = next;
+            m_line_start = nl != end;
+        }
+        m_next.write(m_buffer.data(), m_buffer.size());
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".timestamp.lines", m_lines);
+        stats.add(prefix + ".timestamp.formats", m_text.formats());
+    }
+};
+
+} // namespace rkt
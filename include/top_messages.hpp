@@ -0,0 +1,229 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "spdlog/fmt/fmt.h"
+
+#include "framing.hpp"
+#include "sink.hpp"
+
+namespace rkt {
+
+/**
+ * Approximate counts of the most frequent keys of a stream in bounded memory.
+ *
+ * Implements the Space-Saving algorithm: at most capacity keys are
+ * counted, and when a new key arrives with every slot in use it replaces
+ * the key with the lowest count and inherits that count as its possible
+ * overestimate. Any key occurring more than n / capacity times in a stream
+ * of n keys is guaranteed to be counted. Slots are kept in an indexed
+ * min-heap on count, so each key costs one hash lookup and O(log capacity)
+ * heap work.
+ *
+ * This class is not thread safe.
+ */
+class space_saving {
+public:
+    /** A counted key. */
+    struct entry {
+        std::string key;
+        std::uint64_t count;
+        /** Amount by which count may exceed the true count. */
+        std::uint64_t error;
+    };
+
+private:
+    std::size_t m_capacity;
+    std::vector<entry> m_entries;
+    std::vector<std::size_t> m_heap;      // entry indices, lowest count first
+    std::vector<std::size_t> m_position;  // heap position of each entry
+    std::unordered_map<std::string, std::size_t> m_index;
+    std::uint64_t m_evictions{0};
+
+    bool less(std::size_t a, std::size_t b) const noexcept {
+        return m_entries[m_heap[a]].count < m_entries[m_heap[b]].count;
+    }
+
+    void swap_nodes(std::size_t a, std::size_t b) noexcept {
+        std::swap(m_heap[a], m_heap[b]);
+        m_position[m_heap[a]] = a;
+        m_position[m_heap[b]] = b;
+    }
+
+    void sift_up(std::size_t i) noexcept {
+        while (i > 0 && less(i, (i - 1) / 2)) {
+            swap_nodes(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void sift_down(std::size_t i) noexcept {
+        for (;;) {
+            std::size_t smallest = i;
+            const std::size_t left = 2 * i + 1;
+            const std::size_t right = left + 1;
+            if (left < m_heap.size() && less(left, smallest)) smallest = left;
+            if (right < m_heap.size() && less(right, smallest)) smallest = right;
+            if (smallest == i) return;
+            swap_nodes(i, smallest);
+            i = smallest;
+        }
+    }
+
+public:
+    /**
+     * @param capacity Number of keys counted, must be positive
+     */
+    explicit space_saving(std::size_t capacity) : m_capacity(capacity ? capacity : 1) {
+        m_entries.reserve(m_capacity);
+        m_heap.reserve(m_capacity);
+        m_position.reserve(m_capacity);
+        m_index.reserve(m_capacity);
+    }
+
+    /** Counts one occurrence of a key. */
+    void add(const std::string& key) {
+        if (auto it = m_index.find(key); it != m_index.end()) {
+            ++m_entries[it->second].count;
+            sift_down(m_position[it->second]);
+            return;
+        }
+        if (m_entries.size() < m_capacity) {
+            m_entries.push_back({key, 1, 0});
+            m_heap.push_back(m_entries.size() - 1);
+            m_position.push_back(m_heap.size() - 1);
+            m_index.emplace(key, m_entries.size() - 1);
+            sift_up(m_heap.size() - 1);
+            return;
+        }
+        // Replace the key with the lowest count.
+        const std::size_t victim = m_heap[0];
+        entry& e = m_entries[victim];
+        m_index.erase(e.key);
+        e.key = key;
+        e.error = e.count;
+        ++e.count;
+        m_index.emplace(key, victim);
+        sift_down(0);
+        ++m_evictions;
+    }
+
+    /**
+     * Returns the most frequent keys, highest count first.
+     *
+     * @param n Largest number of keys returned
+     */
+    std::vector<entry> top(std::size_t n) const {
+        std::vector<entry> result(m_entries);
+        n = std::min(n, result.size());
+        std::partial_sort(result.begin(), result.begin() + n, result.end(),
+                          [](const entry& a, const entry& b) { return a.count > b.count; });
+        result.resize(n);
+        return result;
+    }
+
+    /** Returns the number of keys that replaced another. */
+    std::uint64_t evictions() const noexcept { return m_evictions; }
+};
+
+/**
+ * Stage that summarizes the most frequent message templates of a stream.
+ *
+ * Each line is reduced to a template by replacing every word that contains
+ * a digit - numbers, hex values, dates and times, ids - with "#", so
+ * "retry 3 of 10 at 12:01:07" and "retry 4 of 10 at 12:01:09" count as the
+ * same message. Templates are truncated to max_template bytes and counted
+ * with a space_saving summary, so memory use is fixed however much output
+ * there is. The data is forwarded unchanged.
+ */
+class top_messages_stage : public stage {
+public:
+    /** Longest template kept. */
+    static constexpr std::size_t max_template = 200;
+
+private:
+    std::size_t m_top;
+    space_saving m_summary;
+    line_framer m_framer;
+    std::string m_template;
+    bool m_continuation{false};
+    std::uint64_t m_lines{0};
+
+    void normalize(std::string_view line) {
+        m_template.clear();
+        std::size_t i = 0;
+        while (i < line.size() && m_template.size() < max_template) {
+            const auto c = static_cast<unsigned char>(line[i]);
+            if (!std::isalnum(c)) {
+                m_template.push_back(line[i++]);
+                continue;
+            }
+            std::size_t end = i;
+            bool digit = false;
+            while (end < line.size() && std::isalnum(static_cast<unsigned char>(line[end]))) {
+                digit = digit || std::isdigit(static_cast<unsigned char>(line[end]));
+                ++end;
+            }
+            if (digit) {
+                m_template.push_back('#');
+            } else {
+                m_template.append(line.substr(i, end - i));
+            }
+            i = end;
+        }
+        if (m_template.size() > max_template) m_template.resize(max_template);
+    }
+
+    void on_line(std::string_view line, bool terminated) {
+        // Only the first piece of an overlong line is counted.
+        if (!m_continuation) {
+            ++m_lines;
+            normalize(line);
+            m_summary.add(m_template);
+        }
+        m_continuation = !terminated;
+    }
+
+public:
+    /**
+     * @param next Sink that receives the unchanged data
+     * @param top Number of templates reported
+     * @param capacity Number of templates counted; more gives more accurate counts
+     */
+    top_messages_stage(sink& next, std::size_t top, std::size_t capacity)
+        : stage(next), m_top(top), m_summary(std::max(capacity, top)) {
+        m_template.reserve(max_template + 1);
+    }
+
+    void write(const char* data, std::size_t size) override {
+        m_framer.feed(data, size, [this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        m_next.write(data, size);
+    }
+
+    void finish() override {
+        m_framer.flush([this](std::string_view line, bool terminated) { on_line(line, terminated); });
+        stage::finish();
+    }
+
+    void report(statistics& stats, const std::string& prefix) const override {
+        stats.add(prefix + ".top.lines", m_lines);
+        stats.add(prefix + ".top.evictions", m_summary.evictions());
+        std::uint64_t max_error = 0;
+        std::size_t rank = 0;
+        for (const auto& e : m_summary.top(m_top)) {
+            stats.add(fmt::format("{}.top.{}", prefix, ++rank), fmt::format("{} {}", e.count, e.key));
+            max_error = std::max(max_error, e.error);
+        }
+        stats.add(prefix + ".top.max_error", max_error);
+    }
+};
+
+} // namespace rkt
@@ -20,12 +20,36 @@
 #include <vector>
 #include <algorithm>
 #include <thread>
+#include <tuple>
 
+#include "archive.hpp"
+#include "checksum.hpp"
+#include "compact.hpp"
+#include "compression.hpp"
+#include "encoding.hpp"
 #include "errors.hpp"
+#include "escalate.hpp"
 #include "file.hpp"
+#include "filter.hpp"
+#include "hold.hpp"
+#include "json.hpp"
+#include "limit.hpp"
+#include "line_index.hpp"
+#include "merge.hpp"
 #include "pipe.hpp"
+#include "rate_limit.hpp"
+#include "records.hpp"
+#include "redact.hpp"
+#include "route.hpp"
+#include "segment.hpp"
+#include "sink.hpp"
+#include "source.hpp"
+#include "statistics.hpp"
 #include "strings.hpp"
 #include "syscalls.hpp"
+#include "tee.hpp"
+#include "timestamp.hpp"
+#include "top_messages.hpp"
 #include "c_string_vector.hpp"
 
 #include "argparse/argparse.hpp"
@@ -46,6 +70,8 @@ extern "OS_UPSTACK" {
 using bpxwdyn_t = decltype(bpxwdyn_fn);
 
 static int shutdown_ecb = 0;
+// Bit set in an ECB when it is posted.
+static constexpr int ecb_posted = 0x40000000;
 static int fd_map[3];
 static pid_t child_pid = 0;
 
@@ -129,11 +155,10 @@ static void setup_signal_handlers() {
     syscalls::checked_sigaction(SIGCHLD, &sa, nullptr);
 }
 
-// Spawn the target program or login shell with redirected I/O.
+// Spawn the target program or login shell with redirected I/O and the given environment.
 // Sets up process group and inheritance options.
-static void spawn_program(rkt::c_string_vector& args) {
+static void spawn_program(rkt::c_string_vector& args, rkt::c_string_vector& envp) {
     spdlog::debug("Spawning program...");
-    auto envp = make_env();
     if (!args.is_empty()) {
         spdlog::debug("Running program {}", args[0]);
         args.push_back(nullptr); // Null-terminate argv array
@@ -152,10 +177,201 @@ static void spawn_program(rkt::c_string_vector& args) {
     }
 }
 
+// Record format and compression options for one output stream.
+struct output_options {
+    std::string recfm;
+    int lrecl = 0;
+    int blksize = 0;
+    std::string delimiter;
+    std::string compress;
+    std::string index;
+    std::vector<std::string> tee;
+    int head_kb = 0;
+    int head_lines = 0;
+    int tail_kb = 0;
+    int rate_kb = 0;
+    int rate_lines = 0;
+
+    bool is_record() const { return !recfm.empty(); }
+    bool is_compressed() const { return compress != "none"; }
+    // Record and compressed output is written in binary.
+    bool is_binary() const { return is_record() || is_compressed(); }
+};
+
+// Compression options shared by all output streams.
+struct compress_options {
+    int level = Z_DEFAULT_COMPRESSION;
+    int flush_kb = 0;
+    int threads = 1;
+    int chunk_kb = 128;
+    int frame_kb = 1024;
+};
+
+// Add the record format arguments for an output stream, e.g. --stdout-recfm.
+static void add_output_arguments(argparse::ArgumentParser& program, const std::string& stream, output_options& options) {
+    program.add_argument("--" + stream + "-recfm")
+           .help("writes " + stream + " as records of this format - FB, VB")
+           .default_value(std::string{})
+           .store_into(options.recfm);
+    program.add_argument("--" + stream + "-lrecl")
+           .help("the record length used by --" + stream + "-recfm")
+           .default_value(80)
+           .store_into(options.lrecl);
+    program.add_argument("--" + stream + "-blksize")
+           .help("the block size used by --" + stream + "-recfm. Default is the largest that fits 32760")
+           .default_value(0)
+           .store_into(options.blksize);
+    program.add_argument("--" + stream + "-record-delimiter")
+           .help("how " + stream + " records are delimited for VB - newline, or length for a 4 byte big-endian length prefix")
+           .default_value(std::string{"newline"})
+           .choices("newline", "length")
+           .store_into(options.delimiter);
+    program.add_argument("--" + stream + "-compress")
+           .help("compresses " + stream + " as it is written - none, gzip, deflate, or seekable for gzip frames with an index")
+           .default_value(std::string{"none"})
+           .choices("none", "gzip", "deflate", "seekable")
+           .store_into(options.compress);
+    program.add_argument("--" + stream + "-index")
+           .help("the index file written with --" + stream + "-compress seekable")
+           .default_value(std::string{})
+           .store_into(options.index);
+    program.add_argument("--" + stream + "-tee")
+           .help("also writes " + stream + " to this DD or file, from its own thread; may be repeated")
+           .append()
+           .store_into(options.tee);
+    program.add_argument("--" + stream + "-head-kb")
+           .help("writes only the first KB of " + stream + ", then keeps the tail set by --" + stream + "-tail-kb")
+           .default_value(0)
+           .store_into(options.head_kb);
+    program.add_argument("--" + stream + "-head-lines")
+           .help("writes only the first lines of " + stream + ", then keeps the tail set by --" + stream + "-tail-kb")
+           .default_value(0)
+           .store_into(options.head_lines);
+    program.add_argument("--" + stream + "-tail-kb")
+           .help("writes the last KB of " + stream + " after the head when the program ends, with the bytes omitted in between")
+           .default_value(0)
+           .store_into(options.tail_kb);
+    program.add_argument("--" + stream + "-rate-kb")
+           .help("limits " + stream + " to this many KB per second, as set by --rate-when-over")
+           .default_value(0)
+           .store_into(options.rate_kb);
+    program.add_argument("--" + stream + "-rate-lines")
+           .help("limits " + stream + " to this many lines per second, as set by --rate-when-over")
+           .default_value(0)
+           .store_into(options.rate_lines);
+}
+
+// Push the compression stage selected by the options, if any.
+static void push_compress_stage(rkt::pipeline& pipeline, const output_options& options, const compress_options& compress,
+                                rkt::file& index) {
+    if (!options.is_compressed()) return;
+    if (compress.level < Z_DEFAULT_COMPRESSION || compress.level > Z_BEST_COMPRESSION) {
+        throw std::invalid_argument("--compress-level must be between 0 and 9");
+    }
+    if (compress.flush_kb < 0) throw std::invalid_argument("--compress-flush-kb must not be negative");
+    if (compress.threads <= 0) throw std::invalid_argument("--compress-threads must be positive");
+    if (compress.chunk_kb <= 0) throw std::invalid_argument("--compress-chunk-kb must be positive");
+    if (options.compress == "seekable") {
+        if (compress.frame_kb <= 0) throw std::invalid_argument("--compress-frame-kb must be positive");
+        pipeline.push<rkt::seekable_archive_sink>(index, static_cast<std::size_t>(compress.frame_kb) * 1024,
+                                                  compress.level);
+        return;
+    }
+    auto format = options.compress == "gzip" ? rkt::compression::format::gzip : rkt::compression::format::zlib;
+    if (compress.threads > 1) {
+        // Parallel compression writes independent gzip members, which only gzip can concatenate.
+        if (format != rkt::compression::format::gzip) {
+            throw std::invalid_argument("--compress-threads requires gzip compression for " + pipeline.name());
+        }
+        pipeline.push<rkt::parallel_deflate_sink>(compress.level, static_cast<std::size_t>(compress.threads),
+                                                  static_cast<std::size_t>(compress.chunk_kb) * 1024);
+        return;
+    }
+    pipeline.push<rkt::deflate_sink>(format, compress.level, static_cast<std::size_t>(compress.flush_kb) * 1024);
+}
+
+// Push the record output stage selected by the options, if any.
+static void push_record_stage(rkt::pipeline& pipeline, const output_options& options) {
+    if (!options.is_record()) return;
+    if (options.lrecl <= 0) throw std::invalid_argument(pipeline.name() + " record length must be positive");
+    if (options.blksize < 0) throw std::invalid_argument(pipeline.name() + " block size must not be negative");
+    if (options.recfm == "FB") {
+        pipeline.push<rkt::fixed_record_sink>(static_cast<std::size_t>(options.lrecl),
+                                              static_cast<std::size_t>(options.blksize));
+    } else if (options.recfm == "VB") {
+        auto delimiter = options.delimiter == "length"
+            ? rkt::variable_record_sink::delimiter::length
+            : rkt::variable_record_sink::delimiter::newline;
+        pipeline.push<rkt::variable_record_sink>(static_cast<std::size_t>(options.lrecl),
+                                                 static_cast<std::size_t>(options.blksize), delimiter);
+    } else {
+        throw std::invalid_argument("Unsupported record format " + options.recfm + " for " + pipeline.name());
+    }
+}
+
+// Push the stage that keeps the head and tail of the stream, if limits are set.
+static void push_limit_stage(rkt::pipeline& pipeline, const output_options& options) {
+    if (options.head_kb < 0 || options.head_lines < 0 || options.tail_kb < 0) {
+        throw std::invalid_argument(pipeline.name() + " head and tail limits must not be negative");
+    }
+    if (options.head_kb == 0 && options.head_lines == 0 && options.tail_kb == 0) return;
+    if (options.is_record() && options.delimiter == "length") {
+        throw std::invalid_argument(pipeline.name() + " head and tail limits cannot be used with a record delimiter of length");
+    }
+    pipeline.push<rkt::limit_stage>(static_cast<std::uint64_t>(options.head_kb) * 1024,
+                                    static_cast<std::uint64_t>(options.head_lines),
+                                    static_cast<std::size_t>(options.tail_kb) * 1024);
+}
+
+// Push the stage that limits the rate of the stream, if limits are set.
+static void push_rate_limit_stage(rkt::pipeline& pipeline, const output_options& options, bool drop) {
+    if (options.rate_kb < 0 || options.rate_lines < 0) {
+        throw std::invalid_argument(pipeline.name() + " rate limits must not be negative");
+    }
+    if (options.rate_kb == 0 && options.rate_lines == 0) return;
+    if (drop && options.is_record() && options.delimiter == "length") {
+        throw std::invalid_argument(pipeline.name() + " lines cannot be dropped with a record delimiter of length");
+    }
+    pipeline.push<rkt::rate_limit_stage>(options.rate_kb * 1024.0, static_cast<double>(options.rate_lines), drop);
+}
+
 // Main execution loop.
 // Parses arguments, sets up I/O redirection, spawns the child, and relays stdin/stdout/stderr until termination.
 static int run(int argc, const char* argv[]) {
     bool disable_console_commands = false;
+    bool detect_encoding = false;
+    int detect_sample_kb = 4;
+    int stdin_lrecl = 0;
+    bool stdin_decompress = false;
+    std::string stdout_line_index;
+    int line_index_every = 10000;
+    std::string line_index_patterns;
+    std::string stdout_segment;
+    int segment_mb = 0;
+    int segment_seconds = 0;
+    bool stderr_on_failure = false;
+    int failure_buffer_kb = 1024;
+    std::string rate_when_over;
+    int tee_queue_kb = 1024;
+    std::string tee_when_full;
+    bool timestamp = false;
+    bool merge_stderr = false;
+    bool merge_markers = false;
+    bool compact_repeats = false;
+    bool compact_mask_digits = false;
+    std::string json_rules;
+    std::string route_rules;
+    std::string filter_patterns;
+    std::string filter_mode;
+    bool redact = false;
+    std::string redact_rules;
+    std::vector<std::string> redact_env;
+    std::string rc_rules;
+    int top_messages = 0;
+    std::string checksum;
+    std::string metrics_file;
+    output_options stdout_options, stderr_options;
+    compress_options compress;
     std::string log_level;
     std::vector<std::string> program_args;
     argparse::ArgumentParser program("RKTBATCH");
@@ -167,6 +383,147 @@ static int run(int argc, const char* argv[]) {
            .default_value(std::string{"info"})
            .choices("trace", "debug", "info", "warn", "error")
            .store_into(log_level);
+    program.add_argument("--detect-encoding")
+           .help("detects the encoding of STDOUT and STDERR and converts ASCII or UTF-8 output to EBCDIC")
+           .store_into(detect_encoding);
+    program.add_argument("--detect-sample-kb")
+           .help("the number of KB sampled by --detect-encoding")
+           .default_value(4)
+           .store_into(detect_sample_kb);
+    program.add_argument("--stdin-lrecl")
+           .help("reads STDIN as fixed-length records of this length, stripping trailing blanks and adding new lines")
+           .default_value(0)
+           .store_into(stdin_lrecl);
+    program.add_argument("--stdin-decompress")
+           .help("decompresses STDIN if it is gzip or zlib compressed")
+           .store_into(stdin_decompress);
+    add_output_arguments(program, "stdout", stdout_options);
+    add_output_arguments(program, "stderr", stderr_options);
+    program.add_argument("--compress-level")
+           .help("the compression level used by --stdout-compress and --stderr-compress, 0 (store only) to 9 (smallest)")
+           .default_value(6)
+           .store_into(compress.level);
+    program.add_argument("--compress-flush-kb")
+           .help("flushes compressed output after this many KB of input so it can be read while the program runs")
+           .default_value(0)
+           .store_into(compress.flush_kb);
+    program.add_argument("--compress-threads")
+           .help("the number of threads compressing gzip output; more than one writes a multi-member gzip file")
+           .default_value(1)
+           .store_into(compress.threads);
+    program.add_argument("--compress-chunk-kb")
+           .help("the KB of input compressed as one gzip member when --compress-threads is more than one")
+           .default_value(128)
+           .store_into(compress.chunk_kb);
+    program.add_argument("--compress-frame-kb")
+           .help("the KB of input in each independently decompressible frame of a seekable archive")
+           .default_value(1024)
+           .store_into(compress.frame_kb);
+    program.add_argument("--stdout-line-index")
+           .help("writes an index of the line offsets of STDOUT to this file, for rktlines")
+           .default_value(std::string{})
+           .store_into(stdout_line_index);
+    program.add_argument("--line-index-every")
+           .help("the number of lines between the offsets sampled by --stdout-line-index")
+           .default_value(10000)
+           .store_into(line_index_every);
+    program.add_argument("--line-index-patterns")
+           .help("also indexes the lines of STDOUT that match a pattern in this file, one literal or re:regex per line")
+           .default_value(std::string{})
+           .store_into(line_index_patterns);
+    program.add_argument("--stdout-segment")
+           .help("writes STDOUT to numbered segment files named with this prefix instead of the STDOUT DD")
+           .default_value(std::string{})
+           .store_into(stdout_segment);
+    program.add_argument("--segment-mb")
+           .help("starts a new --stdout-segment file at the first line end after this many MB")
+           .default_value(0)
+           .store_into(segment_mb);
+    program.add_argument("--segment-seconds")
+           .help("starts a new --stdout-segment file at the first line end after this many seconds")
+           .default_value(0)
+           .store_into(segment_seconds);
+    program.add_argument("--stderr-on-failure")
+           .help("holds STDERR back and only writes it if the return code is not 0 or the program ends with a signal")
+           .store_into(stderr_on_failure);
+    program.add_argument("--failure-buffer-kb")
+           .help("the KB of STDERR held in memory by --stderr-on-failure before it is moved to a temporary file")
+           .default_value(1024)
+           .store_into(failure_buffer_kb);
+    program.add_argument("--rate-when-over")
+           .help("what happens to output over a rate limit - delay the program, or drop lines")
+           .default_value(std::string{"delay"})
+           .choices("delay", "drop")
+           .store_into(rate_when_over);
+    program.add_argument("--tee-queue-kb")
+           .help("the KB of output queued for each --stdout-tee and --stderr-tee target")
+           .default_value(1024)
+           .store_into(tee_queue_kb);
+    program.add_argument("--tee-when-full")
+           .help("what happens to output for a tee target whose queue is full - wait, or drop it for that target")
+           .default_value(std::string{"wait"})
+           .choices("wait", "drop")
+           .store_into(tee_when_full);
+    program.add_argument("--timestamp")
+           .help("prefixes every line of STDOUT and STDERR with the local time it was relayed")
+           .store_into(timestamp);
+    program.add_argument("--merge-stderr")
+           .help("writes STDERR to STDOUT, merged line by line in the order it was read")
+           .store_into(merge_stderr);
+    program.add_argument("--merge-markers")
+           .help("prefixes every line merged by --merge-stderr with O for STDOUT or E for STDERR")
+           .store_into(merge_markers);
+    program.add_argument("--compact-repeats")
+           .help("replaces repeats of the previous line of STDOUT or STDERR with a count")
+           .store_into(compact_repeats);
+    program.add_argument("--compact-mask-digits")
+           .help("treats lines that differ only in their digits as repeats for --compact-repeats")
+           .store_into(compact_mask_digits);
+    program.add_argument("--json-rules")
+           .help("counts, drops or routes JSON lines of STDOUT and STDERR by the field rules in this file")
+           .default_value(std::string{})
+           .store_into(json_rules);
+    program.add_argument("--route-rules")
+           .help("writes the lines of STDOUT and STDERR that match a NAME PATTERN rule in this file to the DD NAME instead")
+           .default_value(std::string{})
+           .store_into(route_rules);
+    program.add_argument("--filter-patterns")
+           .help("drops the lines of STDOUT and STDERR that match a pattern in this file, one literal or re:regex per line")
+           .default_value(std::string{})
+           .store_into(filter_patterns);
+    program.add_argument("--filter-mode")
+           .help("whether lines matching --filter-patterns are dropped or are the only lines kept - drop, keep")
+           .default_value(std::string{"drop"})
+           .choices("drop", "keep")
+           .store_into(filter_mode);
+    program.add_argument("--redact")
+           .help("masks the credentials in HTTP Authorization headers in STDOUT and STDERR")
+           .store_into(redact);
+    program.add_argument("--redact-rules")
+           .help("masks the secrets listed in this file, one per line, or the token after each prefix:text line")
+           .default_value(std::string{})
+           .store_into(redact_rules);
+    program.add_argument("--redact-env")
+           .help("masks the value of this environment variable of the program; may be repeated")
+           .append()
+           .store_into(redact_env);
+    program.add_argument("--rc-rules")
+           .help("raises the return code, or stops the program, when STDOUT or STDERR has a line matching a rule in this file")
+           .default_value(std::string{})
+           .store_into(rc_rules);
+    program.add_argument("--top-messages")
+           .help("reports the N most frequent STDERR messages, with numbers ignored, in the step statistics")
+           .default_value(0)
+           .store_into(top_messages);
+    program.add_argument("--checksum")
+           .help("computes a digest of STDIN, STDOUT and STDERR as they are relayed - none, crc32c, or sha256 for both")
+           .default_value(std::string{"none"})
+           .choices("none", "crc32c", "sha256")
+           .store_into(checksum);
+    program.add_argument("--metrics-file")
+           .help("writes the step statistics to this file as name=value lines")
+           .default_value(std::string{})
+           .store_into(metrics_file);
     program.add_argument("program")
            .remaining()
            .store_into(program_args)
@@ -188,9 +545,11 @@ static int run(int argc, const char* argv[]) {
     }
 
     // Open STDIN, STDOUT, STDERR datasets.
-    rkt::file dataset_stdin("//DD:STDIN", "r");
-    rkt::file dataset_stdout("//DD:STDOUT", "w", false);
-    rkt::file dataset_stderr("//DD:STDERR", "w", false);
+    // Records are read and written in binary so no record boundaries are added by the runtime.
+    if (stdin_lrecl < 0) throw std::invalid_argument("--stdin-lrecl must not be negative");
+    rkt::file dataset_stdin("//DD:STDIN", stdin_lrecl > 0 || stdin_decompress ? "rb" : "r");
+    rkt::file dataset_stdout("//DD:STDOUT", stdout_options.is_binary() ? "wb" : "w", false);
+    rkt::file dataset_stderr("//DD:STDERR", stderr_options.is_binary() ? "wb" : "w", false);
 
     spdlog::debug("stdout.is_open({}), stderr.is_open({}))",
                   dataset_stdout.is_open() ? "true" : "false",
@@ -200,6 +559,236 @@ static int run(int argc, const char* argv[]) {
     rkt::file* dataset_stdout_ptr = dataset_stdout.is_open() ? &dataset_stdout : &sysout;
     rkt::file* dataset_stderr_ptr = dataset_stderr.is_open() ? &dataset_stderr : &sysout;
 
+    // Record and compressed output is only written to an allocated STDOUT or STDERR dataset, never to SYSOUT.
+    if (stdout_options.is_binary() && !dataset_stdout.is_open()) {
+        spdlog::warn("STDOUT is not allocated; ignoring --stdout-recfm and --stdout-compress");
+        stdout_options.recfm.clear();
+        stdout_options.compress = "none";
+    }
+    if (stderr_options.is_binary() && !dataset_stderr.is_open()) {
+        spdlog::warn("STDERR is not allocated; ignoring --stderr-recfm and --stderr-compress");
+        stderr_options.recfm.clear();
+        stderr_options.compress = "none";
+    }
+    if (merge_markers && !merge_stderr) throw std::invalid_argument("--merge-markers requires --merge-stderr");
+    if (merge_stderr) {
+        if (stdout_options.is_record() && stdout_options.delimiter == "length") {
+            throw std::invalid_argument("--merge-stderr cannot be used with a record delimiter of length");
+        }
+        if (stderr_options.is_binary()) {
+            spdlog::warn("STDERR is merged into STDOUT; ignoring --stderr-recfm and --stderr-compress");
+            stderr_options.recfm.clear();
+            stderr_options.compress = "none";
+        }
+    }
+
+    // Build the relay pipeline for the child's stdin.
+    rkt::file_source stdin_source(dataset_stdin);
+    rkt::source_pipeline stdin_pipeline("STDIN", stdin_source);
+    if (stdin_decompress) {
+        stdin_pipeline.push<rkt::inflate_source>();
+    }
+    if (stdin_lrecl > 0) {
+        stdin_pipeline.push<rkt::fixed_record_source>(static_cast<std::size_t>(stdin_lrecl));
+    }
+    // The digest is last so it covers exactly what the child reads.
+    if (checksum != "none") {
+        stdin_pipeline.push<rkt::digest_source>(checksum == "sha256");
+    }
+
+    // Open the index files of seekable archives.
+    rkt::file stdout_index, stderr_index;
+    for (auto [options, index, name] : {std::make_tuple(&stdout_options, &stdout_index, "stdout"),
+                                        std::make_tuple(&stderr_options, &stderr_index, "stderr")}) {
+        if (options->compress != "seekable") continue;
+        if (options->index.empty()) throw std::invalid_argument(std::string("--") + name + "-index is required for a seekable archive");
+        index->open(options->index, "w");
+    }
+
+    // Segments are cut at line ends, so STDOUT must be written as text.
+    if (!stdout_segment.empty()) {
+        if (segment_mb < 0 || segment_seconds < 0) {
+            throw std::invalid_argument("--segment-mb and --segment-seconds must not be negative");
+        }
+        if (segment_mb == 0 && segment_seconds == 0) {
+            throw std::invalid_argument("--stdout-segment requires --segment-mb or --segment-seconds");
+        }
+        if (stdout_options.is_binary()) {
+            throw std::invalid_argument("--stdout-segment cannot be used with --stdout-recfm or --stdout-compress");
+        }
+        if (!stdout_line_index.empty()) throw std::invalid_argument("--stdout-segment cannot be used with --stdout-line-index");
+    } else if (segment_mb != 0 || segment_seconds != 0) {
+        throw std::invalid_argument("--segment-mb and --segment-seconds require --stdout-segment");
+    }
+
+    // The line index holds offsets in the STDOUT file, so STDOUT must be a file written as text.
+    rkt::file line_index;
+    if (!line_index_patterns.empty() && stdout_line_index.empty()) {
+        throw std::invalid_argument("--line-index-patterns requires --stdout-line-index");
+    }
+    if (!stdout_line_index.empty()) {
+        if (!dataset_stdout.is_open()) throw std::invalid_argument("--stdout-line-index requires STDOUT to be allocated");
+        if (stdout_options.is_binary()) {
+            throw std::invalid_argument("--stdout-line-index cannot be used with --stdout-recfm or --stdout-compress");
+        }
+        if (line_index_every <= 0) throw std::invalid_argument("--line-index-every must be positive");
+        line_index.open(stdout_line_index, "w");
+    }
+
+    // Build the relay pipelines for the child's stdout and stderr.
+    // Data sets that stages route lines to are shared by both pipelines.
+    rkt::route_targets routes;
+    rkt::file_sink stdout_sink(*dataset_stdout_ptr);
+    rkt::file_sink stderr_sink(*dataset_stderr_ptr);
+    std::unique_ptr<rkt::segment_sink> stdout_segments;
+    if (!stdout_segment.empty()) {
+        stdout_segments = std::make_unique<rkt::segment_sink>(stdout_segment, static_cast<std::uint64_t>(segment_mb) << 20,
+                                                              segment_seconds);
+    }
+    rkt::pipeline stdout_pipeline("STDOUT", stdout_segments ? static_cast<rkt::sink&>(*stdout_segments) : stdout_sink);
+    if (line_index.is_open()) {
+        std::shared_ptr<const rkt::pattern_set> patterns;
+        if (!line_index_patterns.empty()) patterns = rkt::pattern_set::load(line_index_patterns);
+        stdout_pipeline.push<rkt::line_index_sink>(line_index, static_cast<std::uint64_t>(line_index_every), patterns);
+    }
+    push_compress_stage(stdout_pipeline, stdout_options, compress, stdout_index);
+    push_record_stage(stdout_pipeline, stdout_options);
+    push_limit_stage(stdout_pipeline, stdout_options);
+    push_rate_limit_stage(stdout_pipeline, stdout_options, rate_when_over == "drop");
+    // When merging, STDERR ends at the merge stage instead of its own data set,
+    // and the merge stage adds the timestamps itself.
+    rkt::merge_stage* merge = merge_stderr
+        ? &stdout_pipeline.push<rkt::merge_stage>(merge_markers, timestamp)
+        : nullptr;
+    rkt::pipeline stderr_pipeline("STDERR", merge ? merge->stderr_port() : stderr_sink);
+    push_compress_stage(stderr_pipeline, stderr_options, compress, stderr_index);
+    push_record_stage(stderr_pipeline, stderr_options);
+    // Held STDERR is rate limited when it is released, so the relay never waits for output that may be discarded;
+    // the head and tail limits still apply before it is held, to bound the temporary file.
+    rkt::hold_stage* stderr_hold = nullptr;
+    if (stderr_on_failure) {
+        if (merge) throw std::invalid_argument("--stderr-on-failure cannot be used with --merge-stderr");
+        if (failure_buffer_kb <= 0) throw std::invalid_argument("--failure-buffer-kb must be positive");
+        push_rate_limit_stage(stderr_pipeline, stderr_options, rate_when_over == "drop");
+        stderr_hold = &stderr_pipeline.push<rkt::hold_stage>(static_cast<std::size_t>(failure_buffer_kb) * 1024);
+    }
+    // A step that fails with an exception ends with RC 12, so the STDERR held
+    // for it is written unless the normal path below released or discarded it.
+    struct hold_guard {
+        rkt::hold_stage* hold;
+        ~hold_guard() {
+            if (!hold || hold->settled() || hold->bytes() == 0) return;
+            try {
+                spdlog::info("Writing the STDERR held by --stderr-on-failure");
+                hold->release();
+            } catch (const std::exception& e) {
+                spdlog::error("Error writing the STDERR held by --stderr-on-failure: {}", e.what());
+            }
+        }
+    } stderr_hold_guard{stderr_hold};
+    push_limit_stage(stderr_pipeline, stderr_options);
+    if (!stderr_hold) push_rate_limit_stage(stderr_pipeline, stderr_options, rate_when_over == "drop");
+    if (timestamp && !merge) {
+        if ((stdout_options.is_record() && stdout_options.delimiter == "length")
+            || (stderr_options.is_record() && stderr_options.delimiter == "length")) {
+            throw std::invalid_argument("--timestamp cannot be used with a record delimiter of length");
+        }
+        stdout_pipeline.push<rkt::timestamp_sink>();
+        stderr_pipeline.push<rkt::timestamp_sink>();
+    }
+    if (compact_mask_digits && !compact_repeats) throw std::invalid_argument("--compact-mask-digits requires --compact-repeats");
+    if (compact_repeats) {
+        stdout_pipeline.push<rkt::compact_stage>(compact_mask_digits);
+        stderr_pipeline.push<rkt::compact_stage>(compact_mask_digits);
+    }
+    if (!route_rules.empty()) {
+        auto rules = rkt::route_rules::load(route_rules, routes);
+        stdout_pipeline.push<rkt::route_stage>(rules);
+        stderr_pipeline.push<rkt::route_stage>(rules);
+    }
+    if (!json_rules.empty()) {
+        rkt::json_rules rules = rkt::json_rules::load(json_rules, routes);
+        stdout_pipeline.push<rkt::json_stage>(rules);
+        stderr_pipeline.push<rkt::json_stage>(std::move(rules));
+    }
+    if (!filter_patterns.empty()) {
+        auto patterns = rkt::pattern_set::load(filter_patterns);
+        spdlog::debug("Loaded {} filter patterns, prefilter bytes {}", patterns->size(), patterns->prefilter_bytes());
+        stdout_pipeline.push<rkt::filter_stage>(patterns, filter_mode == "keep");
+        stderr_pipeline.push<rkt::filter_stage>(patterns, filter_mode == "keep");
+    }
+    // The summary counts every message, including those the filter drops.
+    if (top_messages < 0) throw std::invalid_argument("--top-messages must not be negative");
+    if (top_messages > 0) {
+        // Counting 50 templates for each one reported keeps the counts of the top ones close to exact.
+        const auto top = static_cast<std::size_t>(top_messages);
+        stderr_pipeline.push<rkt::top_messages_stage>(top, std::max<std::size_t>(1000, 50 * top));
+    }
+    // Rules see every line, including those the filter drops.
+    rkt::rc_escalator escalator;
+    if (!rc_rules.empty()) {
+        escalator.load(rc_rules);
+        escalator.on_stop([]() { kill_process(child_pid, SIGTERM); });
+        stdout_pipeline.push<rkt::escalate_stage>(escalator, stdout_pipeline.name());
+        stderr_pipeline.push<rkt::escalate_stage>(escalator, stderr_pipeline.name());
+    }
+    // Copies are written after redaction, before lines are filtered or routed.
+    if (tee_queue_kb <= 0) throw std::invalid_argument("--tee-queue-kb must be positive");
+    // Each tee target and route target writes through its own handle, so no data set may be named twice.
+    std::vector<std::string> tee_names;
+    for (const auto* options : {&stdout_options, &stderr_options}) {
+        for (const std::string& name : options->tee) {
+            const std::string opened = rkt::data_set_name(name);
+            if (std::find(tee_names.begin(), tee_names.end(), opened) != tee_names.end() || routes.contains(name)) {
+                throw std::invalid_argument(name + " is named by more than one --stdout-tee, --stderr-tee or route rule");
+            }
+            tee_names.push_back(opened);
+        }
+    }
+    for (auto [options, pipeline] : {std::make_pair(&stdout_options, &stdout_pipeline),
+                                     std::make_pair(&stderr_options, &stderr_pipeline)}) {
+        if (options->tee.empty()) continue;
+        pipeline->push<rkt::tee_stage>(options->tee, static_cast<std::size_t>(tee_queue_kb) * 1024,
+                                       tee_when_full == "drop");
+    }
+
+    // The environment is built before the pipelines so its values can be redacted.
+    rkt::c_string_vector envp = make_env();
+    if (redact || !redact_rules.empty() || !redact_env.empty()) {
+        auto rules = std::make_shared<rkt::redaction_rules>();
+        if (redact) rules->add_defaults();
+        if (!redact_rules.empty()) rules->load(redact_rules);
+        for (const std::string& name : redact_env) {
+            bool found = false;
+            for (const char* entry : envp) {
+                if (entry && strings::starts_with(entry, name + "=")) {
+                    std::string_view value = std::string_view(entry).substr(name.size() + 1);
+                    if (value.size() < rkt::redaction_rules::min_secret) {
+                        throw std::invalid_argument("The value of --redact-env " + name + " is too short to redact");
+                    }
+                    rules->add_secret(value);
+                    found = true;
+                }
+            }
+            if (!found) spdlog::warn("--redact-env {} is not set in the program's environment", name);
+        }
+        rules->build();
+        spdlog::debug("Loaded {} redaction rules", rules->size());
+        stdout_pipeline.push<rkt::redact_stage>(rules);
+        stderr_pipeline.push<rkt::redact_stage>(rules);
+    }
+    if (detect_encoding) {
+        if (detect_sample_kb <= 0) throw std::invalid_argument("--detect-sample-kb must be positive");
+        for (rkt::pipeline* p : {&stdout_pipeline, &stderr_pipeline}) {
+            p->push<rkt::encoding_stage>(static_cast<std::size_t>(detect_sample_kb) * 1024);
+        }
+    }
+    // The digest is last so it covers exactly what the program wrote.
+    if (checksum != "none") {
+        stdout_pipeline.push<rkt::digest_sink>(checksum == "sha256");
+        stderr_pipeline.push<rkt::digest_sink>(checksum == "sha256");
+    }
+
     // Create pipes for child process I/O redirection.
     rkt::pipe pipe_stdin, pipe_stdout, pipe_stderr;
     fd_map[0] = syscalls::dup(pipe_stdin.read_handle());
@@ -234,20 +823,25 @@ static int run(int argc, const char* argv[]) {
     }
 
     rkt::c_string_vector args(program_args);
-    spawn_program(args);
+    spawn_program(args, envp);
 
     // Main I/O relay loop.
     // - Build read/write fd_sets for select: monitor child's stdout/stderr for readability
     //   and the parent → child stdin pipe for writability.
     // - Use selectex with the shutdown ECB so the loop can be interrupted by SIGCHLD.
-    // - If selectex returns 0, the shutdown ECB was posted → exit the loop.
-    // - When the stdin pipe is writable, read from the STDIN dataset and write to the
-    //   child's stdin pipe. If read returns <= 0, close the write end to signal EOF
+    // - If selectex returns 0 and the shutdown ECB was posted → exit the loop.
+    // - When the stdin pipe is writable, read from the STDIN dataset through the stdin
+    //   pipeline and write to the child's stdin pipe. If read returns <= 0, close the write end to signal EOF
     //   to the child and close the dataset.
     // - When the child's stdout/stderr are readable, read from the corresponding pipe
-    //   and write to the appropriate dataset (STDOUT/STDERR or SYSOUT fallback).
+    //   and write it through the stream's pipeline to the appropriate dataset
+    //   (STDOUT/STDERR or SYSOUT fallback).
+    // - With an age limit on STDOUT segments, selectex also times out every second
+    //   so a segment is completed on age while the program writes nothing to STDOUT.
     int maxfd = std::max({pipe_stdin.write_handle(), pipe_stdout.read_handle(), pipe_stderr.read_handle()});
     char buf[4096];
+    const bool expire_segments = stdout_segments && segment_seconds > 0;
+    timeval segment_wait;
 
     while (true) {
         fd_set readfds, writefds;
@@ -262,20 +856,24 @@ static int run(int argc, const char* argv[]) {
         FD_SET(pipe_stdout.read_handle(), &readfds);
         FD_SET(pipe_stderr.read_handle(), &readfds);
         // Wait for I/O activity or for the shutdown ECB to be posted by the SIGCHLD handler.
+        segment_wait = {1, 0};
         int select_rc = syscalls::checked_selectex(
             maxfd + 1,
             &readfds,
             &writefds,
             nullptr,
-            nullptr,
+            expire_segments ? &segment_wait : nullptr,
             &shutdown_ecb
         );
+        if (expire_segments) stdout_segments->expire();
         // selectex returned because the shutdown ECB was posted (child exited or shutdown requested).
-        if (select_rc == 0) break;
+        if (select_rc == 0 && (!expire_segments || (shutdown_ecb & ecb_posted))) break;
+        // The wait timed out with nothing to relay.
+        if (select_rc == 0) continue;
         // If the child's stdin pipe is writable, feed it data from the STDIN dataset.
         if (pipe_stdin.is_write_open() &&
             FD_ISSET(pipe_stdin.write_handle(), &writefds)) {
-            int bytes_read = dataset_stdin.read(buf, sizeof(buf));
+            int bytes_read = stdin_pipeline.read(buf, sizeof(buf));
             spdlog::trace("Read {} bytes from STDIN", bytes_read);
             if (bytes_read > 0) {
                 // Forward input to the child.
@@ -290,23 +888,64 @@ static int run(int argc, const char* argv[]) {
         // Child stdout is readable: forward to STDOUT dataset.
         if (FD_ISSET(pipe_stdout.read_handle(), &readfds)) {
             int bytes_read = pipe_stdout.read(buf, sizeof(buf));
-            (void)dataset_stdout_ptr->write(buf, bytes_read);
+            stdout_pipeline.write(buf, bytes_read);
         }
         // Child stderr is readable: forward to STDERR.
         if (FD_ISSET(pipe_stderr.read_handle(), &readfds)) {
             int bytes_read = pipe_stderr.read(buf, sizeof(buf));
-            (void)dataset_stderr_ptr->write(buf, bytes_read);
+            stderr_pipeline.write(buf, bytes_read);
         }
     }
 
     int return_code = 0;
     int status = 0;
+    bool signaled = false;
     syscalls::checked_waitpid(child_pid, &status, 0);
     if (WIFEXITED(status)) {
         return_code = WEXITSTATUS(status);
         spdlog::debug("Child exited with status {} return_code {}", status, return_code);
         // Normalize SIGTERM exit code to 0.
-        if (int SIGTERM_EXIT = 128 + SIGTERM; return_code == SIGTERM_EXIT) { return_code = 0; }
+        if (int SIGTERM_EXIT = 128 + SIGTERM; return_code == SIGTERM_EXIT) {
+            return_code = 0;
+            signaled = true;
+        }
+    } else if (WIFSIGNALED(status)) {
+        spdlog::debug("Child ended by signal {}", WTERMSIG(status));
+        signaled = true;
+    }
+
+    // The child has been reaped, so a stop rule matched by the last lines has nothing to stop.
+    escalator.on_stop(nullptr);
+
+    // Flush data held back by the pipeline stages and report step statistics.
+    stdout_pipeline.finish();
+    stderr_pipeline.finish();
+    routes.flush();
+    if (escalator.rc() > return_code) {
+        spdlog::info("Return code raised from {} to {} by --rc-rules", return_code, escalator.rc());
+        return_code = escalator.rc();
+    }
+    // STDERR held back by --stderr-on-failure is only written once the return code is final.
+    if (stderr_hold) {
+        if (return_code != 0 || signaled) {
+            stderr_hold->release();
+        } else {
+            stderr_hold->discard();
+        }
+    }
+    rkt::statistics stats;
+    stdin_pipeline.report(stats);
+    stdout_pipeline.report(stats);
+    stderr_pipeline.report(stats);
+    if (!rc_rules.empty()) escalator.report(stats);
+    routes.report(stats);
+    // A step that uses no relay stage logs the same as before statistics were added.
+    const bool staged = stdin_pipeline.has_stages() || stdout_pipeline.has_stages()
+                        || stderr_pipeline.has_stages() || stdout_segments || !metrics_file.empty();
+    stats.log(staged ? spdlog::level::info : spdlog::level::debug);
+    if (!metrics_file.empty()) {
+        rkt::file metrics(metrics_file, "w");
+        stats.write(metrics);
     }
     return return_code;
 }
@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "errors.hpp"
+#include "file.hpp"
+#include "line_index.hpp"
+
+#include "argparse/argparse.hpp"
+
+#include "spdlog/spdlog.h"
+
+#pragma runopts(posix(on))
+
+// Position a file at a byte offset; fseeko takes offsets beyond 2 GB.
+static void seek(const rkt::file& f, std::uint64_t offset) {
+    if (fseeko(static_cast<FILE*>(f), static_cast<off_t>(offset), SEEK_SET) != 0) throwError("Error seeking in file");
+}
+
+// Read the line at the current position, without its new line. Returns false at the end of the file.
+static bool read_line(const rkt::file& f, std::string& line) {
+    FILE* fp = static_cast<FILE*>(f);
+    line.clear();
+    int c;
+    while ((c = std::getc(fp)) != EOF && c != '\n') line.push_back(static_cast<char>(c));
+    if (std::ferror(fp)) throwError("Error reading file");
+    return c != EOF || !line.empty();
+}
+
+// Write a line to stdout, optionally preceded by its number.
+static void emit(const std::string& line, std::uint64_t number, bool numbers) {
+    if (numbers) std::printf("%llu\t", static_cast<unsigned long long>(number));
+    if (std::fwrite(line.data(), 1, line.size(), stdout) != line.size() || std::fputc('\n', stdout) == EOF) {
+        throwError("Error writing to stdout");
+    }
+}
+
+// Print lines first to last, counting from 1.
+static void print_lines(const rkt::file& f, const rkt::line_index::contents& index,
+                        std::uint64_t first, std::uint64_t last, bool numbers) {
+    const auto& start = index.sample_before(first);
+    seek(f, start.offset);
+    std::string line;
+    for (std::uint64_t n = start.line; n <= last && read_line(f, line); ++n) {
+        if (n >= first) emit(line, n, numbers);
+    }
+}
+
+// Print the last count lines.
+static void print_tail(const rkt::file& f, const rkt::line_index::contents& index, std::uint64_t count, bool numbers) {
+    // While the index is being written, the last sample stands in for the end of the file.
+    const std::uint64_t known = index.complete ? index.lines : index.samples.back().line;
+    const auto& start = index.sample_before(known > count ? known - count + 1 : 1);
+    seek(f, start.offset);
+    std::deque<std::string> tail;
+    std::string line;
+    std::uint64_t n = start.line;
+    for (; read_line(f, line); ++n) {
+        tail.push_back(line);
+        if (tail.size() > count) tail.pop_front();
+    }
+    std::uint64_t number = n - tail.size();
+    for (const auto& l : tail) emit(l, number++, numbers);
+}
+
+// Print the last count lines that matched an index pattern.
+static void print_marks(const rkt::file& f, const rkt::line_index::contents& index, std::uint64_t count, bool numbers) {
+    const auto& marks = index.marks;
+    std::string line;
+    for (std::size_t i = marks.size() > count ? marks.size() - count : 0; i < marks.size(); ++i) {
+        seek(f, marks[i].offset);
+        if (read_line(f, line)) emit(line, marks[i].line, numbers);
+    }
+}
+
+// Prints a line range, the last lines or the marked lines of a file indexed by RKTBATCH.
+static int run(int argc, const char* argv[]) {
+    std::string file_name, index_name;
+    std::vector<std::string> lines;
+    int tail = 0;
+    int marks = 0;
+    bool numbers = false;
+    argparse::ArgumentParser program("RKTLINES");
+    program.add_argument("file")
+           .help("the file written to STDOUT with --stdout-line-index")
+           .store_into(file_name);
+    program.add_argument("index")
+           .help("the index written by --stdout-line-index")
+           .store_into(index_name);
+    program.add_argument("--lines")
+           .help("prints lines FIRST to LAST, counting from 1")
+           .nargs(2)
+           .store_into(lines);
+    program.add_argument("--tail")
+           .help("prints the last N lines")
+           .default_value(0)
+           .store_into(tail);
+    program.add_argument("--marks")
+           .help("prints the last N lines that matched a --line-index-patterns pattern")
+           .default_value(0)
+           .store_into(marks);
+    program.add_argument("--numbers")
+           .help("prefixes each line with its line number and a tab")
+           .store_into(numbers);
+
+    program.parse_args(argc, argv);
+
+    if (lines.empty() + (tail <= 0) + (marks <= 0) != 2) {
+        throw std::invalid_argument("Exactly one of --lines, --tail or --marks is required");
+    }
+
+    rkt::line_index::contents index = rkt::line_index::read_index(index_name);
+    rkt::file f(file_name, "r");
+    if (!lines.empty()) {
+        print_lines(f, index, std::stoull(lines[0]), std::stoull(lines[1]), numbers);
+    } else if (tail > 0) {
+        print_tail(f, index, static_cast<std::uint64_t>(tail), numbers);
+    } else {
+        print_marks(f, index, static_cast<std::uint64_t>(marks), numbers);
+    }
+    return 0;
+}
+
+int main(int argc, const char* argv[]) {
+    try {
+        return run(argc, argv);
+    } catch (const std::exception& e) {
+        spdlog::error(e.what());
+        return 12;
+    }
+}
@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "archive.hpp"
+#include "errors.hpp"
+#include "file.hpp"
+
+#include "argparse/argparse.hpp"
+
+#include "spdlog/spdlog.h"
+
+#pragma runopts(posix(on))
+
+// Write part of a decompressed frame to stdout.
+static void emit(const std::string& data, std::size_t begin, std::size_t end) {
+    if (begin >= end) return;
+    if (std::fwrite(data.data() + begin, 1, end - begin, stdout) != end - begin) {
+        throwError("Error writing to stdout");
+    }
+}
+
+// Extract the uncompressed bytes [offset, offset + length).
+static void extract_bytes(const rkt::file& archive, const std::vector<rkt::archive::frame>& frames,
+                          std::uint64_t offset, std::uint64_t length) {
+    const std::uint64_t end = offset + length;
+    for (const auto& f : frames) {
+        if (f.offset + f.size <= offset) continue;
+        if (f.offset >= end) break;
+        std::string data = rkt::archive::read_frame(archive, f);
+        std::uint64_t begin = offset > f.offset ? offset - f.offset : 0;
+        emit(data, begin, std::min<std::uint64_t>(f.size, end - f.offset));
+    }
+}
+
+// Extract lines first to last, counting from 1.
+static void extract_lines(const rkt::file& archive, const std::vector<rkt::archive::frame>& frames,
+                          std::uint64_t first, std::uint64_t last) {
+    // Frames are cut in the middle of lines, so a frame whose first byte belongs to
+    // the first line may start partway into it. Start at the last frame that begins
+    // before the first line instead; its leading lines are counted and skipped.
+    std::size_t i = 0;
+    while (i + 1 < frames.size() && frames[i + 1].line < first) ++i;
+    for (; i < frames.size() && frames[i].line <= last; ++i) {
+        std::string data = rkt::archive::read_frame(archive, frames[i]);
+        std::uint64_t line = frames[i].line;
+        std::size_t begin = 0;
+        while (begin < data.size() && line <= last) {
+            std::size_t nl = data.find('\n', begin);
+            std::size_t end = nl == std::string::npos ? data.size() : nl + 1;
+            if (line >= first) emit(data, begin, end);
+            if (nl == std::string::npos) break;
+            ++line;
+            begin = end;
+        }
+    }
+}
+
+// Extract every frame relayed between from and to, in seconds since the epoch.
+static void extract_time(const rkt::file& archive, const std::vector<rkt::archive::frame>& frames,
+                         std::int64_t from, std::int64_t to) {
+    for (std::size_t i = 0; i < frames.size(); ++i) {
+        // A frame spans from its own time to the time of the next frame.
+        std::int64_t frame_end = i + 1 < frames.size() ? frames[i + 1].time : frames[i].time;
+        if (frames[i].time > to) break;
+        if (frame_end < from) continue;
+        std::string data = rkt::archive::read_frame(archive, frames[i]);
+        emit(data, 0, data.size());
+    }
+}
+
+// Extracts a byte range, line range or time window from a seekable archive written by RKTBATCH.
+static int run(int argc, const char* argv[]) {
+    std::string archive_name, index_name;
+    std::vector<std::string> bytes, lines, time;
+    argparse::ArgumentParser program("RKTSEEK");
+    program.add_argument("archive")
+           .help("the archive written by --stdout-compress seekable")
+           .store_into(archive_name);
+    program.add_argument("index")
+           .help("the index written by --stdout-index")
+           .store_into(index_name);
+    program.add_argument("--bytes")
+           .help("extracts LENGTH bytes starting at OFFSET")
+           .nargs(2)
+           .store_into(bytes);
+    program.add_argument("--lines")
+           .help("extracts lines FIRST to LAST, counting from 1")
+           .nargs(2)
+           .store_into(lines);
+    program.add_argument("--time")
+           .help("extracts the frames relayed between FROM and TO, in seconds since the epoch")
+           .nargs(2)
+           .store_into(time);
+
+    program.parse_args(argc, argv);
+
+    if (bytes.empty() + lines.empty() + time.empty() != 2) {
+        throw std::invalid_argument("Exactly one of --bytes, --lines or --time is required");
+    }
+
+    std::vector<rkt::archive::frame> frames = rkt::archive::read_index(index_name);
+    rkt::file archive(archive_name, "rb");
+    if (!bytes.empty()) {
+        extract_bytes(archive, frames, std::stoull(bytes[0]), std::stoull(bytes[1]));
+    } else if (!lines.empty()) {
+        extract_lines(archive, frames, std::stoull(lines[0]), std::stoull(lines[1]));
+    } else {
+        extract_time(archive, frames, std::stoll(time[0]), std::stoll(time[1]));
+    }
+    return 0;
+}
+
+int main(int argc, const char* argv[]) {
+    try {
+        return run(argc, argv);
+    } catch (const std::exception& e) {
+        spdlog::error(e.what());
+        return 12;
+    }
+}